@@ -5,667 +5,7684 @@
 #include <fstream>
 #include <sstream>
 #include <queue>
+#include <deque>
 #include <stack>
 #include <omp.h>
 #include <climits>
+#include <limits>
+#include <type_traits>
 #include <unordered_set>
+#include <unordered_map>
+#include <memory>
 #include <algorithm>
+#include <numeric>
 #include <cctype>
 #include <ctime>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <cstdint>
+#include <charconv>
+#include <string_view>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <csignal>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#endif
 using namespace std;
 
 struct LinkedList;
 
-struct Node
+// FNV-1a, with the high bits folded down since hash tables index with the low bits
+uint64_t hashText(string_view text)
 {
-  int id;
-  string code;
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : text)
+  {
+    hash = (hash ^ c) * 1099511628211ULL;
+  }
+  return hash ^ (hash >> 32);
+}
+
+// Instrumentation: scoped timers for load and build phases, per query counters
+// and latency histograms, dumped as JSON or Chrome trace events (--metrics,
+// --trace, or the batch/server metrics command). Build with
+// -DNO_INSTRUMENTATION to compile every hook down to nothing.
+enum Counter
+{
+  CounterPathSettled,
+  CounterPathRelaxed,
+  CounterPrimSettled,
+  CounterPrimRelaxed,
+  CounterBfsPushes,
+  CounterQueueComparisons,
+  CounterRowsParsed,
+  CounterBordersResolved,
+  CounterCacheRefused,
+  CounterKinds
+};
+const char *CounterNames[CounterKinds] = {"pathNodesSettled", "pathEdgesRelaxed", "primNodesSettled", "primEdgesRelaxed",
+                                          "bfsQueuePushes", "queueComparisons", "csvRowsParsed", "bordersResolved",
+                                          "cacheInsertsRefused"};
+
+enum Latency
+{
+  LatencyPath,
+  LatencyPrim,
+  LatencyTraversal,
+  LatencySearch,
+  LatencyFilter,
+  LatencyCommand,
+  LatencyKinds,
+  LatencyNone = -1
+};
+const char *LatencyNames[LatencyKinds] = {"path", "prim", "traversal", "search", "filter", "command"};
+
+#ifdef COUNT_ALLOCATIONS
+// Heap allocations made by the calling thread, counted by the replacement
+// operator new below for --check-allocations. The memory comes from malloc,
+// so the plain and sized operator delete are replaced to free it; the array
+// and nothrow forms forward to these two, and aligned allocations are left
+// to the library on both sides.
+thread_local uint64_t threadAllocations = 0;
+
+void *operator new(size_t size)
+{
+  threadAllocations++;
+  void *memory = malloc(size ? size : 1);
+  if (memory == nullptr)
+    throw bad_alloc();
+  return memory;
+}
+
+// GCC pairs operator new with these by name and warns about the free()
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *memory) noexcept
+{
+  free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+  free(memory);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+#ifndef NO_INSTRUMENTATION
+// Log-linear buckets: exact below 8 ns, then four per power of two (about 19% wide)
+const int LatencyBuckets = 256;
+
+int latencyBucket(uint64_t ns)
+{
+  if (ns < 8)
+    return ns;
+  int exponent = 63 - __builtin_clzll(ns);
+  return 8 + (exponent - 3) * 4 + ((ns >> (exponent - 2)) & 3);
+}
+
+uint64_t latencyBucketStart(int bucket)
+{
+  if (bucket < 8)
+    return bucket;
+  int exponent = (bucket - 8) / 4 + 3;
+  return (uint64_t)(4 + (bucket - 8) % 4) << (exponent - 2);
+}
+
+// Tallies of one thread. Only the owner writes them, with a relaxed load and
+// store instead of a locked add, and dumps sum every thread's.
+struct ThreadTally
+{
+  atomic<uint64_t> counters[CounterKinds];
+  atomic<uint64_t> latency[LatencyKinds][LatencyBuckets];
+  atomic<uint64_t> latencyTotal[LatencyKinds];
+  atomic<uint64_t> latencyMax[LatencyKinds];
+};
+
+void bump(atomic<uint64_t> &value, uint64_t amount)
+{
+  value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+class Instrumentation
+{
+public:
+  Instrumentation() : origin(chrono::steady_clock::now()) {}
+
+  // ns since the program started
+  uint64_t now()
+  {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - origin).count();
+  }
+
+  void count(Counter counter, uint64_t amount = 1)
+  {
+    bump(tally().counters[counter], amount);
+  }
+
+  // Ends a timer started at start: a query adds its latency to the histogram
+  // of its kind, a phase (LatencyNone) to the phase totals. Both become trace
+  // events while tracing.
+  void finish(const char *name, int kind, uint64_t start)
+  {
+    uint64_t end = now(), ns = end - start;
+    if (kind != LatencyNone)
+    {
+      ThreadTally &mine = tally();
+      bump(mine.latency[kind][latencyBucket(ns)], 1);
+      bump(mine.latencyTotal[kind], ns);
+      if (ns > mine.latencyMax[kind].load(memory_order_relaxed))
+        mine.latencyMax[kind].store(ns, memory_order_relaxed);
+    }
+    if (kind != LatencyNone && !tracing)
+      return;
+    lock_guard<mutex> hold(lock);
+    if (kind == LatencyNone)
+    {
+      auto phase = find_if(phases.begin(), phases.end(), [&](Phase &p)
+                           { return strcmp(p.name, name) == 0; });
+      if (phase == phases.end())
+        phase = phases.insert(phases.end(), {name, 0, 0});
+      phase->calls++;
+      phase->ns += ns;
+    }
+    if (tracing && events.size() < MaxEvents)
+      events.push_back({name, start, ns, threadNumber()});
+    else if (tracing)
+      droppedEvents++;
+  }
+
+  void startTracing()
+  {
+    tracing = true;
+  }
+
+  // {"counters":{...},"phases":{name:{"calls","ms"}},"latency":{kind:{"count","meanUs","p50Us","p90Us","p99Us","maxUs"}}}
+  string json()
+  {
+    uint64_t counters[CounterKinds] = {};
+    vector<uint64_t> buckets(LatencyKinds * LatencyBuckets, 0);
+    uint64_t total[LatencyKinds] = {}, largest[LatencyKinds] = {};
+    lock_guard<mutex> hold(lock);
+    for (auto &thread : threads)
+    {
+      for (int c = 0; c < CounterKinds; c++)
+      {
+        counters[c] += thread->counters[c].load(memory_order_relaxed);
+      }
+      for (int k = 0; k < LatencyKinds; k++)
+      {
+        for (int b = 0; b < LatencyBuckets; b++)
+        {
+          buckets[k * LatencyBuckets + b] += thread->latency[k][b].load(memory_order_relaxed);
+        }
+        total[k] += thread->latencyTotal[k].load(memory_order_relaxed);
+        largest[k] = max(largest[k], thread->latencyMax[k].load(memory_order_relaxed));
+      }
+    }
+    ostringstream out;
+    out << "{\"counters\":{";
+    for (int c = 0; c < CounterKinds; c++)
+    {
+      out << (c ? "," : "") << '"' << CounterNames[c] << "\":" << counters[c];
+    }
+    out << "},\"phases\":{";
+    for (size_t p = 0; p < phases.size(); p++)
+    {
+      out << (p ? "," : "") << '"' << phases[p].name << "\":{\"calls\":" << phases[p].calls << ",\"ms\":" << phases[p].ns / 1e6 << '}';
+    }
+    out << "},\"latency\":{";
+    for (int k = 0; k < LatencyKinds; k++)
+    {
+      uint64_t *histogram = &buckets[k * LatencyBuckets];
+      uint64_t calls = accumulate(histogram, histogram + LatencyBuckets, (uint64_t)0);
+      out << (k ? "," : "") << '"' << LatencyNames[k] << "\":{\"count\":" << calls;
+      if (calls > 0)
+      {
+        out << ",\"meanUs\":" << total[k] / 1e3 / calls;
+        for (int percent : {50, 90, 99})
+        {
+          out << ",\"p" << percent << "Us\":" << min(percentile(histogram, calls, percent), largest[k]) / 1e3;
+        }
+        out << ",\"maxUs\":" << largest[k] / 1e3;
+      }
+      out << '}';
+    }
+    out << "}}";
+    return out.str();
+  }
+
+  // Chrome trace-event JSON (chrome://tracing, Perfetto): one complete event
+  // per timed phase or query, then the counters
+  bool writeTrace(string fileName)
+  {
+    FILE *file = fopen(fileName.c_str(), "wb");
+    if (file == nullptr)
+      return false;
+    lock_guard<mutex> hold(lock);
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+    for (auto &event : events)
+    {
+      fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n",
+              event.name, event.thread, event.start / 1e3, event.ns / 1e3);
+    }
+    fprintf(file, "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":%.3f,\"args\":{", now() / 1e3);
+    for (int c = 0; c < CounterKinds; c++)
+    {
+      uint64_t sum = 0;
+      for (auto &thread : threads)
+      {
+        sum += thread->counters[c].load(memory_order_relaxed);
+      }
+      fprintf(file, "%s\"%s\":%llu", c ? "," : "", CounterNames[c], (unsigned long long)sum);
+    }
+    fprintf(file, "}}\n],\"droppedEvents\":%llu}\n", (unsigned long long)droppedEvents);
+    return fclose(file) == 0;
+  }
+
+private:
+  struct Phase
+  {
+    const char *name;
+    uint64_t calls;
+    uint64_t ns;
+  };
+  struct TraceEvent
+  {
+    const char *name;
+    uint64_t start;
+    uint64_t ns;
+    int thread;
+  };
+  static const size_t MaxEvents = 1 << 20;
+
+  chrono::steady_clock::time_point origin;
+  mutex lock;
+  vector<unique_ptr<ThreadTally>> threads;
+  vector<Phase> phases;
+  vector<TraceEvent> events;
+  uint64_t droppedEvents = 0;
+  atomic<bool> tracing{false};
+
+  ThreadTally &tally()
+  {
+    thread_local ThreadTally *mine = nullptr;
+    if (mine == nullptr)
+    {
+      lock_guard<mutex> hold(lock);
+      threads.emplace_back(new ThreadTally());
+      mine = threads.back().get();
+    }
+    return *mine;
+  }
+
+  // Small trace id of the calling thread, under lock
+  int threadNumber()
+  {
+    thread_local int number = -1;
+    if (number == -1)
+      number = nextThread++;
+    return number;
+  }
+  int nextThread = 0;
+
+  // End of the bucket holding the percent-th percentile, an upper bound on it
+  uint64_t percentile(uint64_t *histogram, uint64_t calls, int percent)
+  {
+    uint64_t rank = (calls * percent + 99) / 100, seen = 0;
+    for (int b = 0; b < LatencyBuckets; b++)
+    {
+      seen += histogram[b];
+      if (seen >= rank)
+        return latencyBucketStart(b + 1);
+    }
+    return 0;
+  }
+};
+#else
+class Instrumentation
+{
+public:
+  uint64_t now()
+  {
+    return 0;
+  }
+  void count(Counter, uint64_t = 1) {}
+  void finish(const char *, int, uint64_t) {}
+  void startTracing() {}
+  string json()
+  {
+    return "{}";
+  }
+  bool writeTrace(string)
+  {
+    return false;
+  }
+};
+#endif
+
+Instrumentation instrumentation;
+
+// Times the enclosing scope as a phase, or as a query of the given kind
+class ScopedTimer
+{
+public:
+  ScopedTimer(const char *name, int kind = LatencyNone) : name(name), kind(kind), start(instrumentation.now()) {}
+  ~ScopedTimer()
+  {
+    instrumentation.finish(name, kind, start);
+  }
+
+private:
+  const char *name;
+  int kind;
+  uint64_t start;
+};
+
+// Position of a string inside a StringPool
+struct StringRef
+{
+  uint32_t offset;
+  uint32_t length;
+};
+
+// Append only arena holding every string of a NodeTable. Interning stores
+// identical strings once, so a country named in many border lists costs one copy.
+class StringPool
+{
+public:
+  string arena;
+
+  string_view view(StringRef ref)
+  {
+    return string_view(arena.data() + ref.offset, ref.length);
+  }
+
+  StringRef intern(string_view text)
+  {
+    if ((count + 1) * 2 > slots.size())
+      grow();
+    uint64_t hash = hashText(text);
+    size_t mask = slots.size() - 1;
+    size_t slot = hash & mask;
+    while (slots[slot].length != EMPTY)
+    {
+      if (tags[slot] == (uint32_t)hash && view(slots[slot]) == text)
+        return slots[slot];
+      slot = (slot + 1) & mask;
+    }
+    StringRef ref = {(uint32_t)arena.size(), (uint32_t)text.size()};
+    arena.append(text.data(), text.size());
+    slots[slot] = ref;
+    tags[slot] = (uint32_t)hash;
+    count++;
+    return ref;
+  }
+
+private:
+  static const uint32_t EMPTY = UINT32_MAX;
+  vector<StringRef> slots;
+  vector<uint32_t> tags;
+  size_t count = 0;
+
+  void grow()
+  {
+    vector<StringRef> old;
+    old.swap(slots);
+    slots.assign(max((size_t)64, old.size() * 2), {0, EMPTY});
+    tags.assign(slots.size(), 0);
+    size_t mask = slots.size() - 1;
+    for (auto &ref : old)
+    {
+      if (ref.length == EMPTY)
+        continue;
+      uint64_t hash = hashText(view(ref));
+      size_t slot = hash & mask;
+      while (slots[slot].length != EMPTY)
+      {
+        slot = (slot + 1) & mask;
+      }
+      slots[slot] = ref;
+      tags[slot] = (uint32_t)hash;
+    }
+  }
+};
+
+// Inclusive bounds on the numeric columns of a NodeTable, a row is selected when
+// every value lies inside its range. The defaults leave a column unrestricted.
+struct RangeFilter
+{
+  int minPopulation = INT_MIN;
+  int maxPopulation = INT_MAX;
+  int minArea = INT_MIN;
+  int maxArea = INT_MAX;
+  double minLatitude = -HUGE_VAL;
+  double maxLatitude = HUGE_VAL;
+  double minLongitude = -HUGE_VAL;
+  double maxLongitude = HUGE_VAL;
+};
+
+// Selection bitmask kernels: bit j of mask[w] stands for row 64 * w + j, and the
+// bits of rows with a value outside [low, high] are cleared. The compare is
+// branch free; with AVX2 it runs 8 ints or 4 doubles per instruction.
+void rangeKernel(const int *values, int count, int low, int high, uint64_t *mask)
+{
+  for (int base = 0; base < count; base += 64)
+  {
+    int block = min(64, count - base);
+    const int *v = values + base;
+    uint64_t bits = 0;
+    int j = 0;
+#ifdef __AVX2__
+    __m256i lowVector = _mm256_set1_epi32(low), highVector = _mm256_set1_epi32(high);
+    for (; j + 8 <= block; j += 8)
+    {
+      __m256i x = _mm256_loadu_si256((const __m256i *)(v + j));
+      __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(lowVector, x), _mm256_cmpgt_epi32(x, highVector));
+      bits |= (uint64_t)(~_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xFF) << j;
+    }
+#endif
+    for (; j < block; j++)
+    {
+      bits |= (uint64_t)((v[j] >= low) & (v[j] <= high)) << j;
+    }
+    mask[base / 64] &= bits;
+  }
+}
+
+void rangeKernel(const double *values, int count, double low, double high, uint64_t *mask)
+{
+  for (int base = 0; base < count; base += 64)
+  {
+    int block = min(64, count - base);
+    const double *v = values + base;
+    uint64_t bits = 0;
+    int j = 0;
+#ifdef __AVX2__
+    __m256d lowVector = _mm256_set1_pd(low), highVector = _mm256_set1_pd(high);
+    for (; j + 4 <= block; j += 4)
+    {
+      __m256d x = _mm256_loadu_pd(v + j);
+      __m256d inside = _mm256_and_pd(_mm256_cmp_pd(x, lowVector, _CMP_GE_OQ), _mm256_cmp_pd(x, highVector, _CMP_LE_OQ));
+      bits |= (uint64_t)_mm256_movemask_pd(inside) << j;
+    }
+#endif
+    for (; j < block; j++)
+    {
+      bits |= (uint64_t)((v[j] >= low) & (v[j] <= high)) << j;
+    }
+    mask[base / 64] &= bits;
+  }
+}
+
+// Column store of every country, row i is the country with id i. The borders
+// listed for country i are borderNames[borderOffsets[i] .. borderOffsets[i + 1]).
+// Removed countries keep their row (ids never move) with their bit in present cleared.
+// ids[i] is the id the row was loaded with, which differs from i only once the
+// table has been renumbered, see renumberCountries.
+class NodeTable
+{
+public:
+  vector<uint64_t> present;
+  vector<int> ids;
+  vector<StringRef> codes;
+  vector<StringRef> names;
+  vector<double> latitudes;
+  vector<double> longitudes;
+  vector<int> populations;
+  vector<int> areas;
+  vector<int> borderOffsets = {0};
+  vector<StringRef> borderNames;
+  StringPool strings;
+
+  int size()
+  {
+    return ids.size();
+  }
+  string_view code(int id)
+  {
+    return strings.view(codes[id]);
+  }
+  string_view name(int id)
+  {
+    return strings.view(names[id]);
+  }
+  bool live(int id)
+  {
+    return (present[id / 64] >> (id % 64)) & 1;
+  }
+  // Countries not removed
+  int liveCount()
+  {
+    int count = 0;
+    for (uint64_t word : present)
+    {
+      count += __builtin_popcountll(word);
+    }
+    return count;
+  }
+
+  void reserve(size_t rows)
+  {
+    for (auto *column : {&ids, &populations, &areas})
+    {
+      column->reserve(rows);
+    }
+    codes.reserve(rows);
+    names.reserve(rows);
+    latitudes.reserve(rows);
+    longitudes.reserve(rows);
+    borderOffsets.reserve(rows + 1);
+  }
+
+  // Appends a country and returns its id, its borders are added after it with addBorder
+  int add(string_view code, string_view name, double latitude, double longitude, int population, int area)
+  {
+    int id = ids.size();
+    if (id % 64 == 0)
+      present.push_back(0);
+    present.back() |= 1ULL << (id % 64);
+    ids.push_back(id);
+    codes.push_back(strings.intern(code));
+    names.push_back(strings.intern(name));
+    latitudes.push_back(latitude);
+    longitudes.push_back(longitude);
+    populations.push_back(population);
+    areas.push_back(area);
+    borderOffsets.push_back(borderOffsets.back());
+    return id;
+  }
+
+  void addBorder(string_view countryName)
+  {
+    borderNames.push_back(strings.intern(countryName));
+    borderOffsets.back()++;
+  }
+
+  // Lists countryName among the borders of an existing country, unless it already is
+  void insertBorder(int id, string_view countryName)
+  {
+    for (int b = borderOffsets[id]; b < borderOffsets[id + 1]; b++)
+    {
+      if (strings.view(borderNames[b]) == countryName)
+        return;
+    }
+    borderNames.insert(borderNames.begin() + borderOffsets[id + 1], strings.intern(countryName));
+    for (size_t i = id + 1; i < borderOffsets.size(); i++)
+    {
+      borderOffsets[i]++;
+    }
+  }
+
+  void eraseBorder(int id, string_view countryName)
+  {
+    for (int b = borderOffsets[id]; b < borderOffsets[id + 1]; b++)
+    {
+      if (strings.view(borderNames[b]) != countryName)
+        continue;
+      borderNames.erase(borderNames.begin() + b);
+      for (size_t i = id + 1; i < borderOffsets.size(); i++)
+      {
+        borderOffsets[i]--;
+      }
+      return;
+    }
+  }
+
+  // Appends every row of other, re-interning its strings into this pool
+  void append(NodeTable &other)
+  {
+    reserve(size() + other.size());
+    borderNames.reserve(borderNames.size() + other.borderNames.size());
+    for (int i = 0; i < other.size(); i++)
+    {
+      add(other.code(i), other.name(i), other.latitudes[i], other.longitudes[i], other.populations[i], other.areas[i]);
+      for (int b = other.borderOffsets[i]; b < other.borderOffsets[i + 1]; b++)
+      {
+        addBorder(other.strings.view(other.borderNames[b]));
+      }
+    }
+  }
+
+  // The rows in the given order (order[i] is the row placed at i). ids keeps
+  // each row's original id, so renumbered countries still map back to their
+  // CSV rows.
+  NodeTable permuted(vector<int> &order)
+  {
+    NodeTable table;
+    table.reserve(order.size());
+    table.borderNames.reserve(borderNames.size());
+    for (int row : order)
+    {
+      table.add(code(row), name(row), latitudes[row], longitudes[row], populations[row], areas[row]);
+      for (int b = borderOffsets[row]; b < borderOffsets[row + 1]; b++)
+      {
+        table.addBorder(strings.view(borderNames[b]));
+      }
+    }
+    for (size_t i = 0; i < order.size(); i++)
+    {
+      table.ids[i] = ids[order[i]];
+    }
+    return table;
+  }
+
+  // Bitmask of the rows matching filter, see rangeKernel. Columns left unrestricted are skipped.
+  vector<uint64_t> select(RangeFilter &filter)
+  {
+    int count = size();
+    vector<uint64_t> mask = present;
+    if (filter.minPopulation != INT_MIN || filter.maxPopulation != INT_MAX)
+      rangeKernel(populations.data(), count, filter.minPopulation, filter.maxPopulation, mask.data());
+    if (filter.minArea != INT_MIN || filter.maxArea != INT_MAX)
+      rangeKernel(areas.data(), count, filter.minArea, filter.maxArea, mask.data());
+    if (filter.minLatitude != -HUGE_VAL || filter.maxLatitude != HUGE_VAL)
+      rangeKernel(latitudes.data(), count, filter.minLatitude, filter.maxLatitude, mask.data());
+    if (filter.minLongitude != -HUGE_VAL || filter.maxLongitude != HUGE_VAL)
+      rangeKernel(longitudes.data(), count, filter.minLongitude, filter.maxLongitude, mask.data());
+    return mask;
+  }
+
+  void displayNode(int id, int count)
+  {
+    cout << count << ". " << name(id) << " (" << code(id) << ")" << endl;
+    cout << "Population: " << populations[id] << endl;
+    cout << "Area in KM square: " << areas[id] << endl;
+    cout << "Adjacent Countries: ";
+    for (int b = borderOffsets[id]; b < borderOffsets[id + 1]; b++)
+    {
+      cout << strings.view(borderNames[b]);
+      if (b + 1 < borderOffsets[id + 1])
+        cout << ", ";
+    }
+    cout << endl
+         << endl;
+  }
+};
+
+double toRadians(double degree)
+{
+  return degree * M_PI / 180.0;
+}
+
+// Earth radius in kilometers, shared by the scalar and batch kernels
+const double EarthRadiusKm = 6371.0;
+
+// Function to calculate the Haversine distance between two points
+double haversineDistance(double lat1, double lon1, double lat2, double lon2)
+{
+  // Convert degrees to radians
+  lat1 = toRadians(lat1);
+  lon1 = toRadians(lon1);
+  lat2 = toRadians(lat2);
+  lon2 = toRadians(lon2);
+
+  // Calculate differences in coordinates
+  double dLat = lat2 - lat1;
+  double dLon = lon2 - lon1;
+
+  // Haversine formula
+  double a = sin(dLat / 2) * sin(dLat / 2) +
+             cos(lat1) * cos(lat2) * sin(dLon / 2) * sin(dLon / 2);
+  double c = 2 * atan2(sqrt(a), sqrt(1 - a));
+
+  // Calculate distance
+  double distance = EarthRadiusKm * c;
+
+  return distance;
+}
+
+// sin(x) = x + x u P(u) with u = x * x, a Chebyshev fit on |x| <= pi / 2 with
+// absolute error below 1e-15
+const double SinCoefficients[7] = {-0.1666666666666664, 0.008333333333325811, -0.00019841269836389582, 2.7557318037433015e-06,
+                                   -2.5051971462996632e-08, 1.6050925110515604e-10, -7.407529668965278e-13};
+// asin(r) = r + r z P(z) with z = r * r, a Chebyshev fit on 0 <= r <= 0.5 with
+// absolute error below 1e-14
+const double AsinCoefficients[10] = {0.16666666666662155, 0.07500000003594615, 0.044642852428912506, 0.030382183109429667, 0.02236605952903119,
+                                     0.01744156718705199, 0.013187436503358185, 0.01567756701260805, -0.0029439091682434086, 0.02791075706481934};
+
+// Coordinates in radians with cos(latitude) precomputed, the columns the
+// batch haversine kernels read
+struct GeoColumns
+{
+  vector<double> latitude;
+  vector<double> longitude;
+  vector<double> cosLatitude;
+
+  int size()
+  {
+    return latitude.size();
+  }
+
+  // From columns in degrees
+  void assign(vector<double> &latitudes, vector<double> &longitudes)
+  {
+    int n = latitudes.size();
+    latitude.resize(n);
+    longitude.resize(n);
+    cosLatitude.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+      latitude[i] = toRadians(latitudes[i]);
+      longitude[i] = toRadians(longitudes[i]);
+      cosLatitude[i] = cos(latitude[i]);
+    }
+  }
+};
+
+// Scalar forms of the kernels below, used for the tails that do not fill a
+// vector and for builds without AVX2. The kernels agree with
+// haversineDistance to within 1e-7 km, 1e-12 relative (see --bench-haversine).
+double sinPolynomial(double x)
+{
+  double u = x * x;
+  double p = SinCoefficients[6];
+  for (int i = 5; i >= 0; i--)
+  {
+    p = p * u + SinCoefficients[i];
+  }
+  return x + x * u * p;
+}
+
+// asin on [0, 1]; above 0.5 through asin(s) = pi / 2 - 2 asin(sqrt((1 - s) / 2))
+double asinPolynomial(double s)
+{
+  bool upper = s > 0.5;
+  double z = upper ? (1 - s) * 0.5 : s * s;
+  double r = upper ? sqrt(z) : s;
+  double p = AsinCoefficients[9];
+  for (int i = 8; i >= 0; i--)
+  {
+    p = p * z + AsinCoefficients[i];
+  }
+  double angle = r + r * z * p;
+  return upper ? M_PI / 2 - 2 * angle : angle;
+}
+
+// sin^2 of half of an angle difference in [-2 pi, 2 pi], folded into [0, pi / 2]
+double halfSinSquared(double difference)
+{
+  double half = fabs(difference) * 0.5;
+  double s = sinPolynomial(min(half, M_PI - half));
+  return s * s;
+}
+
+double haversineKernel(double latitude1, double cosLatitude1, double latitude2, double cosLatitude2, double longitudeDifference)
+{
+  double a = halfSinSquared(latitude2 - latitude1) + cosLatitude1 * cosLatitude2 * halfSinSquared(longitudeDifference);
+  return 2 * EarthRadiusKm * asinPolynomial(sqrt(min(a, 1.0)));
+}
+
+#ifdef __AVX2__
+__m256d gather4(const double *column, __m128i indexes)
+{
+  // The masked form with an explicit zero source, the plain gather trips
+  // maybe-uninitialized warnings in some GCC versions
+  return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), column, indexes, _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 8);
+}
+
+__m256d horner4(__m256d x, const double *coefficients, int degree)
+{
+  __m256d p = _mm256_set1_pd(coefficients[degree]);
+  for (int i = degree - 1; i >= 0; i--)
+  {
+    p = _mm256_add_pd(_mm256_mul_pd(p, x), _mm256_set1_pd(coefficients[i]));
+  }
+  return p;
+}
+
+__m256d halfSinSquared4(__m256d difference)
+{
+  __m256d half = _mm256_mul_pd(_mm256_andnot_pd(_mm256_set1_pd(-0.0), difference), _mm256_set1_pd(0.5));
+  __m256d x = _mm256_min_pd(half, _mm256_sub_pd(_mm256_set1_pd(M_PI), half));
+  __m256d u = _mm256_mul_pd(x, x);
+  __m256d s = _mm256_add_pd(x, _mm256_mul_pd(_mm256_mul_pd(x, u), horner4(u, SinCoefficients, 6)));
+  return _mm256_mul_pd(s, s);
+}
+
+__m256d asinPolynomial4(__m256d s)
+{
+  __m256d upper = _mm256_cmp_pd(s, _mm256_set1_pd(0.5), _CMP_GT_OQ);
+  __m256d z = _mm256_blendv_pd(_mm256_mul_pd(s, s), _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(1.0), s), _mm256_set1_pd(0.5)), upper);
+  __m256d r = _mm256_blendv_pd(s, _mm256_sqrt_pd(z), upper);
+  __m256d angle = _mm256_add_pd(r, _mm256_mul_pd(_mm256_mul_pd(r, z), horner4(z, AsinCoefficients, 9)));
+  __m256d folded = _mm256_sub_pd(_mm256_set1_pd(M_PI / 2), _mm256_add_pd(angle, angle));
+  return _mm256_blendv_pd(angle, folded, upper);
+}
+
+__m256d haversineKernel4(__m256d latitude1, __m256d cosLatitude1, __m256d latitude2, __m256d cosLatitude2, __m256d longitudeDifference)
+{
+  __m256d a = _mm256_add_pd(halfSinSquared4(_mm256_sub_pd(latitude2, latitude1)),
+                            _mm256_mul_pd(_mm256_mul_pd(cosLatitude1, cosLatitude2), halfSinSquared4(longitudeDifference)));
+  __m256d s = _mm256_sqrt_pd(_mm256_min_pd(a, _mm256_set1_pd(1.0)));
+  return _mm256_mul_pd(_mm256_set1_pd(2 * EarthRadiusKm), asinPolynomial4(s));
+}
+#endif
+
+// Great circle km from (latitude, longitude) in degrees to every point
+void haversineOneToMany(double latitude, double longitude, GeoColumns &points, double *distances)
+{
+  int n = points.size();
+  double latitude1 = toRadians(latitude), longitude1 = toRadians(longitude), cosLatitude1 = cos(latitude1);
+  int i = 0;
+#ifdef __AVX2__
+  __m256d latitude4 = _mm256_set1_pd(latitude1), longitude4 = _mm256_set1_pd(longitude1), cosLatitude4 = _mm256_set1_pd(cosLatitude1);
+  for (; i + 4 <= n; i += 4)
+  {
+    __m256d longitudeDifference = _mm256_sub_pd(_mm256_loadu_pd(&points.longitude[i]), longitude4);
+    _mm256_storeu_pd(distances + i, haversineKernel4(latitude4, cosLatitude4, _mm256_loadu_pd(&points.latitude[i]), _mm256_loadu_pd(&points.cosLatitude[i]), longitudeDifference));
+  }
+#endif
+  for (; i < n; i++)
+  {
+    distances[i] = haversineKernel(latitude1, cosLatitude1, points.latitude[i], points.cosLatitude[i], points.longitude[i] - longitude1);
+  }
+}
+
+// Great circle km between points from[i] and to[i] for each of count pairs
+void haversinePairs(GeoColumns &points, const int *from, const int *to, int count, double *distances)
+{
+  int i = 0;
+#ifdef __AVX2__
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)(from + i)), b = _mm_loadu_si128((const __m128i *)(to + i));
+    __m256d longitudeDifference = _mm256_sub_pd(gather4(points.longitude.data(), b), gather4(points.longitude.data(), a));
+    _mm256_storeu_pd(distances + i, haversineKernel4(gather4(points.latitude.data(), a), gather4(points.cosLatitude.data(), a),
+                                                     gather4(points.latitude.data(), b), gather4(points.cosLatitude.data(), b), longitudeDifference));
+  }
+#endif
+  for (; i < count; i++)
+  {
+    distances[i] = haversineKernel(points.latitude[from[i]], points.cosLatitude[from[i]], points.latitude[to[i]], points.cosLatitude[to[i]],
+                                   points.longitude[to[i]] - points.longitude[from[i]]);
+  }
+}
+
+// Open addressing (linear probing) hash index from a country's name or code to
+// its id. Slots only hold ids, keys are compared against the nodes themselves.
+class CountryIndex
+{
+public:
+  void build(NodeTable &nodes, bool byCode)
+  {
+    this->byCode = byCode;
+    size_t capacity = 16;
+    while (capacity < 2 * (size_t)nodes.size())
+    {
+      capacity *= 2;
+    }
+    mask = capacity - 1;
+    slots.assign(capacity, -1);
+    tags.assign(capacity, 0);
+    for (int id = 0; id < nodes.size(); id++)
+    {
+      if (nodes.live(id))
+        place(nodes, id);
+    }
+  }
+
+  // Adds a country appended to nodes, rebuilding once the table is half full
+  void insert(NodeTable &nodes, int id)
+  {
+    if (2 * (size_t)nodes.size() > slots.size())
+      build(nodes, byCode);
+    else
+      place(nodes, id);
+  }
+
+  // Takes a country out. The entries after it in its probe run are shifted
+  // back into the hole when their home slot allows, so no lookup stops early.
+  void erase(NodeTable &nodes, int id)
+  {
+    if (slots.empty())
+      return;
+    size_t slot = hashText(keyOf(nodes, id)) & mask;
+    while (slots[slot] != -1 && slots[slot] != id)
+    {
+      slot = (slot + 1) & mask;
+    }
+    if (slots[slot] == -1)
+      return;
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & mask; slots[next] != -1; next = (next + 1) & mask)
+    {
+      size_t home = tags[next] & mask;
+      if (((next - home) & mask) >= ((next - hole) & mask))
+      {
+        slots[hole] = slots[next];
+        tags[hole] = tags[next];
+        hole = next;
+      }
+    }
+    slots[hole] = -1;
+  }
+
+  // Id of the country with this key, -1 if there is none
+  int find(NodeTable &nodes, string_view key)
+  {
+    if (slots.empty())
+      return -1;
+    uint64_t hash = hashText(key);
+    for (size_t slot = hash & mask; slots[slot] != -1; slot = (slot + 1) & mask)
+    {
+      if (tags[slot] == (uint32_t)hash && keyOf(nodes, slots[slot]) == key)
+        return slots[slot];
+    }
+    return -1;
+  }
+
+  // The hash table itself, so a snapshot can store it and skip the rebuild
+  vector<int> &slotTable() { return slots; }
+  vector<uint32_t> &tagTable() { return tags; }
+  void adopt(vector<int> &slotTable, vector<uint32_t> &tagTable, bool byCode)
+  {
+    this->byCode = byCode;
+    slots.swap(slotTable);
+    tags.swap(tagTable);
+    mask = slots.size() - 1;
+  }
+
+private:
+  bool byCode = false;
+  size_t mask = 0;
+  vector<int> slots;
+  vector<uint32_t> tags; // low hash bits, rejects most mismatches without touching the node
+
+  string_view keyOf(NodeTable &nodes, int id)
+  {
+    return byCode ? nodes.code(id) : nodes.name(id);
+  }
+
+  void place(NodeTable &nodes, int id)
+  {
+    string_view key = keyOf(nodes, id);
+    uint64_t hash = hashText(key);
+    size_t slot = hash & mask;
+    while (slots[slot] != -1 && !(tags[slot] == (uint32_t)hash && keyOf(nodes, slots[slot]) == key))
+    {
+      slot = (slot + 1) & mask;
+    }
+    // Keep the first loaded country with a given key
+    if (slots[slot] == -1 || nodes.ids[id] < nodes.ids[slots[slot]])
+    {
+      slots[slot] = id;
+      tags[slot] = (uint32_t)hash;
+    }
+  }
+};
+
+char foldCase(char c)
+{
+  return (char)tolower((unsigned char)c);
+}
+
+// Case folded suffix arrays over every country name, answer substring queries
+// with a binary search instead of a scan. Names are stored back to back in
+// text, each ending in '\0' so suffix comparisons stop at the end of a name.
+// Suffixes are split by where they start (name start, word start, elsewhere)
+// so the best ranked matches are the first entries of the first ranges.
+// Fuzzy queries filter names by shared trigrams, then check the edit distance
+// of the query to the closest substring of each candidate. Query scratch is
+// kept in the index, so one index must not be searched from several threads.
+class NameSearch
+{
+public:
+  // Per query working memory. Queries sharing a Scratch must not overlap;
+  // threads searching concurrently each bring their own.
+  struct Scratch
+  {
+    vector<int> shared;
+    vector<uint32_t> seen;
+    uint32_t epoch = 0;
+    vector<int> column;
+  };
+
+  bool built()
+  {
+    return !starts.empty();
+  }
+
+  void build(NodeTable &nodes)
+  {
+    int n = nodes.size();
+    rowIds = nodes.ids;
+    text.clear();
+    starts.assign(1, 0);
+    for (int id = 0; id < n; id++)
+    {
+      // Removed countries keep an empty name, which nothing matches
+      for (char c : nodes.live(id) ? nodes.name(id) : string_view())
+      {
+        text.push_back(c == '\0' ? ' ' : foldCase(c));
+      }
+      text.push_back('\0');
+      starts.push_back(text.size());
+    }
+
+    vector<Suffix> groups[3];
+    for (int id = 0; id < n; id++)
+    {
+      for (uint32_t p = starts[id]; p + 1 < starts[id + 1]; p++)
+      {
+        int group = p == starts[id] ? 0 : !isalnum((unsigned char)text[p - 1]) ? 1 : 2;
+        groups[group].push_back({leadingBytes(text.data() + p), p, id});
+      }
+    }
+    const char *base = text.data();
+    for (int group = 0; group < 3; group++)
+    {
+      sort(groups[group].begin(), groups[group].end(), [&](const Suffix &a, const Suffix &b)
+           {
+             if (a.lead != b.lead)
+               return a.lead < b.lead;
+             // Equal leads with a terminator among them are equal strings
+             int order = (a.lead & 0xFF) != 0 ? strcmp(base + a.position + 8, base + b.position + 8) : 0;
+             return order != 0 ? order < 0 : rowIds[a.owner] < rowIds[b.owner]; });
+      positions[group].resize(groups[group].size());
+      owners[group].resize(groups[group].size());
+      for (size_t i = 0; i < groups[group].size(); i++)
+      {
+        positions[group][i] = groups[group][i].position;
+        owners[group][i] = groups[group][i].owner;
+      }
+    }
+
+    // Trigram postings in CSR form, each name listed once per distinct
+    // trigram and every list sorted by id
+    vector<pair<uint32_t, int>> grams;
+    for (int id = 0; id < n; id++)
+    {
+      for (uint32_t p = starts[id]; p + 3 < starts[id + 1]; p++)
+      {
+        grams.push_back({trigram(base + p), id});
+      }
+    }
+    sort(grams.begin(), grams.end());
+    grams.erase(unique(grams.begin(), grams.end()), grams.end());
+    gramKeys.clear();
+    gramOffsets.clear();
+    gramIds.resize(grams.size());
+    for (size_t i = 0; i < grams.size(); i++)
+    {
+      if (i == 0 || grams[i].first != grams[i - 1].first)
+      {
+        gramKeys.push_back(grams[i].first);
+        gramOffsets.push_back(i);
+      }
+      gramIds[i] = grams[i].second;
+    }
+    gramOffsets.push_back(grams.size());
+
+    scratch = Scratch();
+  }
+
+  // Ids of the countries whose name contains query (ignoring case), best first:
+  // the exact name, names starting with the query, names with a word starting
+  // with it, then names containing it anywhere, alphabetical by the matched
+  // text within each group. With maxEdits > 0 names that contain the query
+  // with up to maxEdits typos follow, fewest edits then shortest name first.
+  // Remaining ties go by loaded id (NodeTable::ids). At most limit ids are returned.
+  vector<int> search(string_view query, int limit, int maxEdits = 0)
+  {
+    return search(query, limit, maxEdits, scratch);
+  }
+
+  vector<int> search(string_view query, int limit, int maxEdits, Scratch &scratch)
+  {
+    vector<int> ids;
+    string folded;
+    for (char c : query)
+    {
+      folded.push_back(foldCase(c));
+    }
+    if (!built() || folded.empty() || folded.find('\0') != folded.npos || limit <= 0)
+      return ids;
+    nextEpoch(scratch);
+    vector<uint32_t> &seen = scratch.seen;
+    uint32_t epoch = scratch.epoch;
+
+    // Suffixes starting with the query form one contiguous run of each array
+    const char *base = text.data();
+    size_t m = folded.size();
+    for (int group = 0; group < 3 && (int)ids.size() < limit; group++)
+    {
+      vector<uint32_t> &sorted = positions[group];
+      auto first = lower_bound(sorted.begin(), sorted.end(), folded, [&](uint32_t p, const string &q)
+                               { return strncmp(base + p, q.c_str(), m) < 0; });
+      for (size_t i = first - sorted.begin(); i < sorted.size() && (int)ids.size() < limit; i++)
+      {
+        if (strncmp(base + sorted[i], folded.c_str(), m) != 0)
+          break;
+        int id = owners[group][i];
+        if (seen[id] != epoch)
+        {
+          seen[id] = epoch;
+          ids.push_back(id);
+        }
+      }
+    }
+
+    if (maxEdits > 0 && (int)ids.size() < limit)
+    {
+      vector<tuple<int, int, int>> ranked = fuzzyMatches(folded, maxEdits, limit - ids.size(), scratch); // (edits, name length, id)
+      int count = min((int)ranked.size(), limit - (int)ids.size());
+      partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(), [this](const tuple<int, int, int> &a, const tuple<int, int, int> &b)
+                   { return make_tuple(get<0>(a), get<1>(a), rowIds[get<2>(a)]) < make_tuple(get<0>(b), get<1>(b), rowIds[get<2>(b)]); });
+      for (int i = 0; i < count; i++)
+      {
+        ids.push_back(get<2>(ranked[i]));
+      }
+    }
+    return ids;
+  }
+
+private:
+  struct Suffix
+  {
+    uint64_t lead; // first 8 bytes, big endian, zero padded past the terminator
+    uint32_t position;
+    int owner;
+  };
+
+  string text;
+  vector<int> rowIds;            // NodeTable::ids at build time, for tie breaks
+  vector<uint32_t> starts;       // name id starts at text[starts[id]], starts[n] is the end
+  vector<uint32_t> positions[3]; // name, word and inner suffix starts in suffix order
+  vector<int> owners[3];         // owners[g][i] is the name positions[g][i] falls in
+  vector<uint32_t> gramKeys;
+  vector<uint32_t> gramOffsets;
+  vector<int> gramIds;
+  Scratch scratch;
+
+  static uint64_t leadingBytes(const char *p)
+  {
+    uint64_t lead = 0;
+    int i = 0;
+    for (; i < 8 && p[i] != '\0'; i++)
+    {
+      lead = lead << 8 | (unsigned char)p[i];
+    }
+    return lead << (8 * (8 - i));
+  }
+
+  static uint32_t trigram(const char *p)
+  {
+    return (uint32_t)(unsigned char)p[0] << 16 | (uint32_t)(unsigned char)p[1] << 8 | (unsigned char)p[2];
+  }
+
+  void nextEpoch(Scratch &scratch)
+  {
+    size_t n = starts.size() - 1;
+    if (scratch.seen.size() != n)
+    {
+      scratch.shared.assign(n, 0);
+      scratch.seen.assign(n, 0);
+      scratch.epoch = 0;
+    }
+    if (++scratch.epoch == 0)
+    {
+      fill(scratch.seen.begin(), scratch.seen.end(), 0);
+      scratch.epoch = 1;
+    }
+  }
+
+  // Names not already found whose closest substring is within maxEdits of
+  // the query. An edit removes at most 3 of the query's G distinct trigrams,
+  // so a match shares at least needed = G - 3 * maxEdits of them, and so at
+  // least one of the G - needed + 1 rarest. Candidates come from those lists
+  // only and are counted against the rest by binary search. When needed is
+  // not positive every name has to be checked. Returns at least the need best
+  // matches, unsorted.
+  vector<tuple<int, int, int>> fuzzyMatches(string &folded, int maxEdits, int need, Scratch &scratch)
+  {
+    vector<int> &shared = scratch.shared;
+    vector<uint32_t> &seen = scratch.seen;
+    uint32_t epoch = scratch.epoch;
+    int n = starts.size() - 1;
+    int m = folded.size();
+    vector<uint32_t> queryGrams;
+    for (int i = 0; i + 3 <= m; i++)
+    {
+      queryGrams.push_back(trigram(folded.data() + i));
+    }
+    sort(queryGrams.begin(), queryGrams.end());
+    queryGrams.erase(unique(queryGrams.begin(), queryGrams.end()), queryGrams.end());
+    int needed = (int)queryGrams.size() - 3 * maxEdits;
+    vector<int> candidates;
+    if (needed <= 0)
+    {
+      for (int id = 0; id < n; id++)
+      {
+        if (seen[id] != epoch && starts[id + 1] - starts[id] > 1)
+          candidates.push_back(id);
+      }
+    }
+    else
+    {
+      vector<pair<uint32_t, size_t>> lists; // (length, gram index)
+      for (uint32_t gram : queryGrams)
+      {
+        auto found = lower_bound(gramKeys.begin(), gramKeys.end(), gram);
+        size_t g = found - gramKeys.begin();
+        uint32_t length = found != gramKeys.end() && *found == gram ? gramOffsets[g + 1] - gramOffsets[g] : 0;
+        lists.push_back({length, g});
+      }
+      sort(lists.begin(), lists.end());
+      int probe = (int)lists.size() - needed + 1;
+      vector<int> touched;
+      for (int l = 0; l < (int)lists.size(); l++)
+      {
+        if (lists[l].first == 0)
+          continue;
+        auto begin = gramIds.begin() + gramOffsets[lists[l].second];
+        auto end = begin + lists[l].first;
+        if (l < probe)
+        {
+          for (auto e = begin; e != end; e++)
+          {
+            if (shared[*e]++ == 0)
+              touched.push_back(*e);
+          }
+        }
+        else
+        {
+          for (int id : touched)
+          {
+            shared[id] += binary_search(begin, end, id);
+          }
+        }
+      }
+      for (int id : touched)
+      {
+        if (shared[id] >= needed && seen[id] != epoch)
+          candidates.push_back(id);
+        shared[id] = 0;
+      }
+    }
+    // Check candidates shortest name first: once need of them are one edit
+    // away (the fewest a name not found exactly can have) no longer name can
+    // rank above them. Names of the same length are all checked, their ties
+    // are broken by the caller.
+    vector<vector<int>> byLength;
+    for (int id : candidates)
+    {
+      int length = starts[id + 1] - starts[id] - 1;
+      if (length < m - maxEdits)
+        continue;
+      if (length >= (int)byLength.size())
+        byLength.resize(length + 1);
+      byLength[length].push_back(id);
+    }
+    vector<tuple<int, int, int>> ranked;
+    int closest = 0;
+    for (int length = 0; length < (int)byLength.size() && closest < need; length++)
+    {
+      for (int id : byLength[length])
+      {
+        int edits = substringDistance(folded, string_view(text.data() + starts[id], length), maxEdits, scratch.column);
+        if (edits <= maxEdits)
+          ranked.push_back(make_tuple(edits, length, id));
+        closest += edits == 1;
+      }
+    }
+    return ranked;
+  }
+
+  // Smallest edit distance between pattern and any substring of name (Sellers'
+  // algorithm: a free start anywhere in name), capped at limit + 1
+  int substringDistance(string_view pattern, string_view name, int limit, vector<int> &column)
+  {
+    int m = pattern.size();
+    column.resize(m + 1);
+    for (int i = 0; i <= m; i++)
+    {
+      column[i] = i;
+    }
+    int best = column[m];
+    for (char c : name)
+    {
+      int diagonal = column[0];
+      for (int i = 1; i <= m; i++)
+      {
+        int above = column[i];
+        column[i] = min({above + 1, column[i - 1] + 1, diagonal + (pattern[i - 1] != c)});
+        diagonal = above;
+      }
+      best = min(best, column[m]);
+      if (best == 0)
+        break;
+    }
+    return best <= limit ? best : limit + 1;
+  }
+};
+
+// Indexed binary min-heap of country ids ordered by population (priority 0) or
+// area, ties broken by the id the country was loaded with (NodeTable::ids), so
+// renumbering the graph does not reorder equal keys. position[id] is where id sits in heap (-1 if absent),
+// so keys can be updated or countries removed in O(log n). Reading the queue in
+// order never empties it: the full ordering is sorted once and cached until the
+// queue changes.
+class PriorityQueue
+{
+public:
+  NodeTable *nodes;
+  int priority;
+  vector<int> heap;
+  vector<int> position;
+
+  PriorityQueue(NodeTable &nodes, int priority)
+  {
+    this->nodes = &nodes;
+    this->priority = priority;
+  }
+
+  // Population (priority 0) or area of a country
+  int key(int id)
+  {
+    return priority == 0 ? nodes->populations[id] : nodes->areas[id];
+  }
+
+  bool before(int a, int b)
+  {
+    comparisons++;
+    int keyA = key(a), keyB = key(b);
+    return keyA < keyB || (keyA == keyB && nodes->ids[a] < nodes->ids[b]);
+  }
+
+  int size()
+  {
+    return heap.size();
+  }
+
+  void enqueue(int id)
+  {
+    if ((int)position.size() <= id)
+      position.resize(max(id + 1, nodes->size()), -1);
+    if (position[id] != -1)
+      return;
+    uint64_t start = comparisons;
+    heap.push_back(id);
+    position[id] = heap.size() - 1;
+    siftUp(heap.size() - 1);
+    sorted.clear();
+    instrumentation.count(CounterQueueComparisons, comparisons - start);
+  }
+
+  // Replaces the contents with ids, heapified in O(n)
+  void fill(vector<int> &ids)
+  {
+    heap = ids;
+    position.assign(nodes->size(), -1);
+    for (int i = 0; i < (int)heap.size(); i++)
+    {
+      position[heap[i]] = i;
+    }
+    uint64_t start = comparisons;
+    for (int i = (int)heap.size() / 2 - 1; i >= 0; i--)
+    {
+      siftDown(i);
+    }
+    sorted.clear();
+    instrumentation.count(CounterQueueComparisons, comparisons - start);
+  }
+
+  // Restores the order after the key of id changed in the table
+  void update(int id)
+  {
+    if (id >= (int)position.size() || position[id] == -1)
+      return;
+    siftUp(position[id]);
+    siftDown(position[id]);
+    sorted.clear();
+  }
+
+  void remove(int id)
+  {
+    if (id >= (int)position.size() || position[id] == -1)
+      return;
+    int index = position[id];
+    position[id] = -1;
+    int last = heap.back();
+    heap.pop_back();
+    if (index < (int)heap.size())
+    {
+      heap[index] = last;
+      position[last] = index;
+      siftUp(index);
+      siftDown(position[last]);
+    }
+    sorted.clear();
+  }
+
+  // Every queued id, lowest key first
+  vector<int> &ordered()
+  {
+    if (sorted.size() != heap.size())
+    {
+      sorted = heap;
+      sort(sorted.begin(), sorted.end(), [this](int a, int b)
+           { return before(a, b); });
+    }
+    return sorted;
+  }
+
+  // The k ids with the highest keys, highest first. Uses the cached ordering
+  // when there is one, otherwise one pass over the heap keeping the best k
+  // seen so far in a k entry heap whose front is the lowest of them:
+  // O(n log k) time and O(k) memory, no copy of the queue.
+  vector<int> topK(int k)
+  {
+    k = max(0, min(k, size()));
+    if (sorted.size() == heap.size())
+      return vector<int>(sorted.rbegin(), sorted.rbegin() + k);
+    vector<int> top;
+    if (k == 0)
+      return top;
+    top.reserve(k);
+    auto higher = [this](int a, int b)
+    { return before(b, a); };
+    for (int id : heap)
+    {
+      if ((int)top.size() < k)
+      {
+        top.push_back(id);
+        push_heap(top.begin(), top.end(), higher);
+      }
+      else if (before(top.front(), id))
+      {
+        pop_heap(top.begin(), top.end(), higher);
+        top.back() = id;
+        push_heap(top.begin(), top.end(), higher);
+      }
+    }
+    sort_heap(top.begin(), top.end(), higher);
+    return top;
+  }
+
+  void display(bool ascend)
+  {
+    vector<int> &order = ordered();
+    int count = 0;
+    if (ascend)
+    {
+      for (auto it = order.begin(); it != order.end(); it++)
+      {
+        nodes->displayNode(*it, ++count);
+      }
+    }
+    else
+    {
+      for (auto it = order.rbegin(); it != order.rend(); it++)
+      {
+        nodes->displayNode(*it, ++count);
+      }
+    }
+  }
+
+private:
+  vector<int> sorted;
+  uint64_t comparisons = 0;
+
+  void place(int index, int id)
+  {
+    heap[index] = id;
+    position[id] = index;
+  }
+
+  void siftUp(int index)
+  {
+    int id = heap[index];
+    while (index > 0 && before(id, heap[(index - 1) / 2]))
+    {
+      place(index, heap[(index - 1) / 2]);
+      index = (index - 1) / 2;
+    }
+    place(index, id);
+  }
+
+  void siftDown(int index)
+  {
+    int id = heap[index];
+    int count = heap.size();
+    while (2 * index + 1 < count)
+    {
+      int child = 2 * index + 1;
+      if (child + 1 < count && before(heap[child + 1], heap[child]))
+        child++;
+      if (!before(heap[child], id))
+        break;
+      place(index, heap[child]);
+      index = child;
+    }
+    place(index, id);
+  }
+};
+
+// Answer to a shortest path query, distance is INT_MAX and path is empty
+// when the destination cannot be reached from the source
+struct PathResult
+{
+  int source;
+  int destination;
+  int distance;
+  vector<int> path;
+};
+
+// All pairs shortest path distances, row major: distance[s * stride + t].
+// predecessor holds the node just before t on the path from s (-1 for none).
+// stride is numberOfNodes once built; addNode doubles it when the rows are
+// full, so countries added one by one copy the table O(log n) times.
+struct DistanceTable
+{
+  int numberOfNodes = 0;
+  int stride = 0;
+  uint64_t checksum = 0; // adjacency checksum of the graph the table was built for
+  vector<int> distance;
+  vector<int> predecessor;
+
+  int *row(int source)
+  {
+    return distance.data() + (size_t)source * stride;
+  }
+  int *parents(int source)
+  {
+    return predecessor.data() + (size_t)source * stride;
+  }
+  int at(int source, int destination)
+  {
+    return distance[(size_t)source * stride + destination];
+  }
+
+  // Empty n by n table: every distance INT_MAX, every predecessor -1
+  void reset(int n)
+  {
+    numberOfNodes = n;
+    stride = n;
+    distance.assign((size_t)n * n, INT_MAX);
+    predecessor.assign((size_t)n * n, -1);
+  }
+
+  PathResult path(int source, int destination)
+  {
+    PathResult result;
+    path(source, destination, result);
+    return result;
+  }
+
+  // Same into result, reusing its path's memory
+  void path(int source, int destination, PathResult &result)
+  {
+    result.source = source;
+    result.destination = destination;
+    result.distance = at(source, destination);
+    result.path.clear();
+    if (result.distance == INT_MAX)
+      return;
+    for (int vertex = destination; vertex != -1; vertex = parents(source)[vertex])
+    {
+      result.path.push_back(vertex);
+    }
+    reverse(result.path.begin(), result.path.end());
+  }
+
+  // Grows the table by one node that has no edges yet
+  void addNode()
+  {
+    int n = numberOfNodes + 1;
+    if (n > stride)
+    {
+      int grown = max(2 * stride, 16);
+      vector<int> d((size_t)grown * grown, INT_MAX), p((size_t)grown * grown, -1);
+      for (int source = 0; source < numberOfNodes; source++)
+      {
+        copy(row(source), row(source) + numberOfNodes, d.begin() + (size_t)source * grown);
+        copy(parents(source), parents(source) + numberOfNodes, p.begin() + (size_t)source * grown);
+      }
+      stride = grown;
+      distance.swap(d);
+      predecessor.swap(p);
+    }
+    else
+    {
+      for (int source = 0; source < numberOfNodes; source++)
+      {
+        row(source)[n - 1] = INT_MAX;
+        parents(source)[n - 1] = -1;
+      }
+      fill(row(n - 1), row(n - 1) + n, INT_MAX);
+      fill(parents(n - 1), parents(n - 1) + n, -1);
+    }
+    row(n - 1)[n - 1] = 0;
+    numberOfNodes = n;
+  }
+
+  bool save(string fileName)
+  {
+    ofstream file(fileName, ios::binary);
+    if (!file)
+      return false;
+    const char magic[8] = {'A', 'P', 'S', 'P', 0, 0, 0, 1};
+    file.write(magic, sizeof(magic));
+    file.write((char *)&numberOfNodes, sizeof(numberOfNodes));
+    file.write((char *)&checksum, sizeof(checksum));
+    for (int source = 0; source < numberOfNodes; source++)
+    {
+      file.write((char *)row(source), numberOfNodes * sizeof(int));
+    }
+    for (int source = 0; source < numberOfNodes; source++)
+    {
+      file.write((char *)parents(source), numberOfNodes * sizeof(int));
+    }
+    return (bool)file;
+  }
+
+  // Loads a table saved by save(), refusing it if it was built for a different graph
+  bool load(string fileName, uint64_t expectedChecksum)
+  {
+    ifstream file(fileName, ios::binary);
+    char magic[8];
+    int n;
+    uint64_t sum;
+    if (!file.read(magic, sizeof(magic)) || memcmp(magic, "APSP\0\0\0\1", 8) != 0)
+      return false;
+    if (!file.read((char *)&n, sizeof(n)) || !file.read((char *)&sum, sizeof(sum)) || sum != expectedChecksum)
+      return false;
+    vector<int> d((size_t)n * n), p((size_t)n * n);
+    if (!file.read((char *)d.data(), d.size() * sizeof(int)) || !file.read((char *)p.data(), p.size() * sizeof(int)))
+      return false;
+    numberOfNodes = n;
+    stride = n;
+    checksum = sum;
+    distance.swap(d);
+    predecessor.swap(p);
+    return true;
+  }
+};
+
+// Contraction hierarchy over an undirected CSR graph. Nodes are contracted
+// from least to most important, adding shortcut edges that preserve shortest
+// distances between the remaining nodes. Queries then only search upwards
+// (towards more important nodes) from both ends and meet in the middle.
+class ContractionHierarchy
+{
+public:
+  struct Edge
+  {
+    int to;
+    int weight;
+    int middle; // node the shortcut skips, -1 for an original edge
+  };
+
+  int numberOfNodes = 0;
+  int shortcuts = 0;
+  vector<int> rank;
+  // Upward graph in CSR form, edges from a node to higher ranked nodes sorted by target
+  vector<int> upOffsets;
+  vector<Edge> upEdges;
+
+  bool built()
+  {
+    return numberOfNodes > 0;
+  }
+
+  void build(int n, vector<int> &offsets, vector<int> &neighbors, vector<int> &weights)
+  {
+    numberOfNodes = 0;
+    shortcuts = 0;
+    adjacency.assign(n, {});
+    for (int u = 0; u < n; u++)
+    {
+      for (int e = offsets[u]; e < offsets[u + 1]; e++)
+      {
+        if (neighbors[e] != u)
+          adjacency[u].push_back({neighbors[e], weights[e], -1});
+      }
+    }
+    contracted.assign(n, false);
+    contractedNeighbors.assign(n, 0);
+    witnessDistance.assign(n, INT_MAX);
+    witnessTarget.assign(n, false);
+    rank.assign(n, -1);
+    vector<vector<Edge>> upward(n);
+
+    // Lazy updates: a popped node is re-evaluated and put back if it is no longer the minimum
+    priority_queue<pair<int, int>, vector<pair<int, int>>, greater<pair<int, int>>> order;
+    for (int v = 0; v < n; v++)
+    {
+      order.push(make_pair(priority(v), v));
+    }
+    int nextRank = 0;
+    while (!order.empty())
+    {
+      int v = order.top().second;
+      order.pop();
+      if (contracted[v])
+        continue;
+      int current = priority(v);
+      if (!order.empty() && current > order.top().first)
+      {
+        order.push(make_pair(current, v));
+        continue;
+      }
+      contract(v, false);
+      rank[v] = nextRank++;
+      contracted[v] = true;
+      // v's remaining edges all lead upwards, move them out of the working graph
+      for (auto &edge : adjacency[v])
+      {
+        if (contracted[edge.to])
+          continue;
+        upward[v].push_back(edge);
+        contractedNeighbors[edge.to]++;
+        vector<Edge> &back = adjacency[edge.to];
+        for (int e = 0; e < (int)back.size(); e++)
+        {
+          if (back[e].to == v)
+          {
+            back[e] = back.back();
+            back.pop_back();
+            break;
+          }
+        }
+      }
+    }
+
+    upOffsets.assign(n + 1, 0);
+    upEdges.clear();
+    for (int v = 0; v < n; v++)
+    {
+      sort(upward[v].begin(), upward[v].end(), [](const Edge &a, const Edge &b)
+           { return a.to < b.to; });
+      upEdges.insert(upEdges.end(), upward[v].begin(), upward[v].end());
+      upOffsets[v + 1] = upEdges.size();
+    }
+    adjacency.clear();
+    adjacency.shrink_to_fit();
+    forwardDistance.assign(n, INT_MAX);
+    backwardDistance.assign(n, INT_MAX);
+    forwardParent.assign(n, -1);
+    backwardParent.assign(n, -1);
+    numberOfNodes = n;
+  }
+
+  PathResult query(int source, int destination)
+  {
+    PathResult result;
+    query(source, destination, result);
+    return result;
+  }
+
+  // Same into result, reusing its path's memory. The heaps and per node
+  // arrays are members, so repeated queries allocate nothing.
+  void query(int source, int destination, PathResult &result)
+  {
+    result.source = source;
+    result.destination = destination;
+    result.distance = INT_MAX;
+    result.path.clear();
+    if (source == destination)
+    {
+      result.distance = 0;
+      result.path.push_back(source);
+      return;
+    }
+    auto later = greater<pair<int, int>>();
+    vector<int> *distance[2] = {&forwardDistance, &backwardDistance};
+    vector<int> *parent[2] = {&forwardParent, &backwardParent};
+    int meet = -1;
+    int best = INT_MAX;
+
+    forwardDistance[source] = 0;
+    backwardDistance[destination] = 0;
+    touched.push_back(source);
+    touched.push_back(destination);
+    heaps[0].assign(1, make_pair(0, source));
+    heaps[1].assign(1, make_pair(0, destination));
+    uint64_t settled = 0, relaxed = 0;
+    while (!heaps[0].empty() || !heaps[1].empty())
+    {
+      for (int side = 0; side < 2; side++)
+      {
+        vector<pair<int, int>> &heap = heaps[side];
+        if (heap.empty())
+          continue;
+        // Nothing left on this side can improve on the best meeting point
+        if (heap.front().first >= best)
+        {
+          heap.clear();
+          continue;
+        }
+        pop_heap(heap.begin(), heap.end(), later);
+        int dist = heap.back().first;
+        int vertex = heap.back().second;
+        heap.pop_back();
+        vector<int> &own = *distance[side];
+        vector<int> &other = *distance[1 - side];
+        if (dist > own[vertex])
+          continue;
+        if (other[vertex] != INT_MAX && dist + other[vertex] < best)
+        {
+          best = dist + other[vertex];
+          meet = vertex;
+        }
+        // Stall on demand: a higher node already reached offers a shorter way to vertex,
+        // so vertex cannot be on a shortest up-down path and need not be expanded
+        bool stalled = false;
+        for (int e = upOffsets[vertex]; e < upOffsets[vertex + 1] && !stalled; e++)
+        {
+          stalled = own[upEdges[e].to] != INT_MAX && own[upEdges[e].to] + upEdges[e].weight < dist;
+        }
+        if (stalled)
+          continue;
+        settled++;
+        relaxed += upOffsets[vertex + 1] - upOffsets[vertex];
+        for (int e = upOffsets[vertex]; e < upOffsets[vertex + 1]; e++)
+        {
+          Edge &edge = upEdges[e];
+          if (dist + edge.weight < own[edge.to])
+          {
+            if (own[edge.to] == INT_MAX && other[edge.to] == INT_MAX)
+              touched.push_back(edge.to);
+            own[edge.to] = dist + edge.weight;
+            (*parent[side])[edge.to] = vertex;
+            heap.push_back(make_pair(own[edge.to], edge.to));
+            push_heap(heap.begin(), heap.end(), later);
+          }
+        }
+      }
+    }
+    instrumentation.count(CounterPathSettled, settled);
+    instrumentation.count(CounterPathRelaxed, relaxed);
+
+    if (meet != -1)
+    {
+      result.distance = best;
+      up.clear();
+      for (int vertex = meet; vertex != -1; vertex = forwardParent[vertex])
+      {
+        up.push_back(vertex);
+      }
+      reverse(up.begin(), up.end());
+      for (int vertex = backwardParent[meet]; vertex != -1; vertex = backwardParent[vertex])
+      {
+        up.push_back(vertex);
+      }
+      result.path.push_back(source);
+      for (int i = 1; i < (int)up.size(); i++)
+      {
+        unpack(up[i - 1], up[i], result.path);
+      }
+    }
+
+    // Reset only what this query wrote
+    for (int vertex : touched)
+    {
+      forwardDistance[vertex] = backwardDistance[vertex] = INT_MAX;
+      forwardParent[vertex] = backwardParent[vertex] = -1;
+    }
+    touched.clear();
+  }
+
+private:
+  // Working state, only alive while building
+  vector<vector<Edge>> adjacency;
+  vector<bool> contracted;
+  vector<int> contractedNeighbors;
+  vector<int> witnessDistance;
+  vector<int> witnessTouched;
+  vector<bool> witnessTarget;
+  vector<pair<int, int>> witnessHeap;
+  // Query scratch
+  vector<int> forwardDistance, backwardDistance, forwardParent, backwardParent, touched, up;
+  vector<pair<int, int>> heaps[2];
+
+  // Edge difference plus the number of already contracted neighbours, keeps contraction spread out
+  int priority(int v)
+  {
+    return 2 * (contract(v, true) - (int)adjacency[v].size()) + contractedNeighbors[v];
+  }
+
+  // Bounded Dijkstra from source ignoring the node being contracted, fills witnessDistance.
+  // Stops once every marked target is settled, past limit, or after maxSettled nodes;
+  // giving up early can only cost an unneeded shortcut.
+  void witnessSearch(int source, int skip, int limit, int targets, int maxSettled)
+  {
+    vector<pair<int, int>> &heap = witnessHeap;
+    heap.clear();
+    witnessDistance[source] = 0;
+    witnessTouched.push_back(source);
+    heap.push_back(make_pair(0, source));
+    int settled = 0;
+    while (!heap.empty() && settled < maxSettled)
+    {
+      pop_heap(heap.begin(), heap.end(), greater<pair<int, int>>());
+      int dist = heap.back().first;
+      int vertex = heap.back().second;
+      heap.pop_back();
+      if (dist > witnessDistance[vertex])
+        continue;
+      if (dist > limit)
+        break;
+      settled++;
+      if (witnessTarget[vertex] && --targets == 0)
+        break;
+      for (auto &edge : adjacency[vertex])
+      {
+        if (edge.to == skip)
+          continue;
+        if (dist + edge.weight < witnessDistance[edge.to])
+        {
+          if (witnessDistance[edge.to] == INT_MAX)
+            witnessTouched.push_back(edge.to);
+          witnessDistance[edge.to] = dist + edge.weight;
+          heap.push_back(make_pair(witnessDistance[edge.to], edge.to));
+          push_heap(heap.begin(), heap.end(), greater<pair<int, int>>());
+        }
+      }
+    }
+  }
+
+  // Adds (or just counts, when simulating) the shortcuts needed to remove v
+  int contract(int v, bool simulate)
+  {
+    vector<Edge> &remaining = adjacency[v];
+    int added = 0;
+    for (int a = 0; a + 1 < (int)remaining.size(); a++)
+    {
+      int limit = 0;
+      for (int b = a + 1; b < (int)remaining.size(); b++)
+      {
+        limit = max(limit, remaining[a].weight + remaining[b].weight);
+        witnessTarget[remaining[b].to] = true;
+      }
+      // Estimating priorities only needs a rough shortcut count, keep those searches short
+      witnessSearch(remaining[a].to, v, limit, remaining.size() - a - 1, simulate ? 50 : 1000);
+      int count = remaining.size();
+      for (int b = a + 1; b < count; b++)
+      {
+        witnessTarget[remaining[b].to] = false;
+        int via = remaining[a].weight + remaining[b].weight;
+        if (witnessDistance[remaining[b].to] <= via)
+          continue;
+        added++;
+        if (!simulate)
+          addShortcut(remaining[a].to, remaining[b].to, via, v);
+      }
+      for (int vertex : witnessTouched)
+      {
+        witnessDistance[vertex] = INT_MAX;
+      }
+      witnessTouched.clear();
+    }
+    return added;
+  }
+
+  void addShortcut(int from, int to, int weight, int middle)
+  {
+    for (int side = 0; side < 2; side++)
+    {
+      bool found = false;
+      for (auto &edge : adjacency[from])
+      {
+        if (edge.to == to)
+        {
+          found = true;
+          if (weight < edge.weight)
+            edge = {to, weight, middle};
+        }
+      }
+      if (!found)
+        adjacency[from].push_back({to, weight, middle});
+      swap(from, to);
+    }
+    shortcuts++;
+  }
+
+  // Appends the original nodes after a on the edge a-b, expanding shortcuts recursively
+  void unpack(int a, int b, vector<int> &path)
+  {
+    int low = rank[a] < rank[b] ? a : b;
+    int high = low == a ? b : a;
+    Edge *edge = nullptr;
+    for (int e = upOffsets[low]; e < upOffsets[low + 1]; e++)
+    {
+      if (upEdges[e].to == high)
+        edge = &upEdges[e];
+    }
+    if (edge == nullptr || edge->middle == -1)
+    {
+      path.push_back(b);
+      return;
+    }
+    unpack(a, edge->middle, path);
+    unpack(edge->middle, b, path);
+  }
+};
+
+// Point for (latitude, longitude) in degrees on a sphere of the earth's
+// radius, chord lengths between such points are in km
+void surfacePoint(double latitude, double longitude, double &x, double &y, double &z)
+{
+  latitude = toRadians(latitude);
+  longitude = toRadians(longitude);
+  x = EarthRadiusKm * cos(latitude) * cos(longitude);
+  y = EarthRadiusKm * cos(latitude) * sin(longitude);
+  z = EarthRadiusKm * sin(latitude);
+}
+
+// Great circle km between two surface points a chord apart
+double chordToArc(double chord)
+{
+  return 2 * EarthRadiusKm * asin(min(1.0, chord / (2 * EarthRadiusKm)));
+}
+
+// k-d tree over surface points, each cell split at the median of its widest
+// axis. Straight line (chord) distance orders points the same way as great
+// circle distance, so queries never need trigonometry. Coordinates are copied
+// in tree order so every leaf reads a contiguous block.
+class SpatialIndex
+{
+public:
+  bool built()
+  {
+    return !cells.empty();
+  }
+
+  // Points whose bit is clear in present (when given) are left out
+  void build(vector<double> &x, vector<double> &y, vector<double> &z, vector<uint64_t> *present = nullptr)
+  {
+    cells.clear();
+    vector<Entry> entries;
+    entries.reserve(x.size());
+    for (int i = 0; i < (int)x.size(); i++)
+    {
+      if (!present || ((*present)[i / 64] >> (i % 64)) & 1)
+        entries.push_back({{x[i], y[i], z[i]}, i});
+    }
+    int n = entries.size();
+    if (n > 0)
+      buildCell(entries, 0, n);
+    ids.resize(n);
+    pointX.resize(n);
+    pointY.resize(n);
+    pointZ.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+      ids[i] = entries[i].id;
+      pointX[i] = entries[i].point[0];
+      pointY[i] = entries[i].point[1];
+      pointZ[i] = entries[i].point[2];
+    }
+  }
+
+  // The k points closest to (x, y, z) as (squared chord, id), closest first
+  void nearest(double x, double y, double z, int k, vector<pair<double, int>> &result)
+  {
+    result.clear();
+    if (!built() || k <= 0)
+      return;
+    double query[3] = {x, y, z};
+    searchNearest(0, query, k, result);
+    sort_heap(result.begin(), result.end());
+  }
+
+  // Every point at most chord away from (x, y, z) as (squared chord, id),
+  // closest first
+  void within(double x, double y, double z, double chord, vector<pair<double, int>> &result)
+  {
+    result.clear();
+    if (!built() || chord < 0)
+      return;
+    double query[3] = {x, y, z};
+    searchWithin(0, query, chord * chord, result);
+    sort(result.begin(), result.end());
+  }
+
+private:
+  static const int LeafSize = 16;
+
+  // Bounding box of points begin .. end - 1 (tree order), children are -1 in a leaf
+  struct Cell
+  {
+    double low[3], high[3];
+    int begin, end;
+    int left, right;
+  };
+
+  struct Entry
+  {
+    double point[3];
+    int id;
+  };
+
+  vector<Cell> cells;
+  vector<int> ids; // ids[i] is the point stored at position i
+  vector<double> pointX, pointY, pointZ;
+
+  // Points are partitioned as whole records so the median selection and the
+  // bounding box scans read memory sequentially
+  int buildCell(vector<Entry> &entries, int begin, int end)
+  {
+    int index = cells.size();
+    Cell cell;
+    for (int a = 0; a < 3; a++)
+    {
+      cell.low[a] = HUGE_VAL;
+      cell.high[a] = -HUGE_VAL;
+    }
+    for (int i = begin; i < end; i++)
+    {
+      for (int a = 0; a < 3; a++)
+      {
+        cell.low[a] = min(cell.low[a], entries[i].point[a]);
+        cell.high[a] = max(cell.high[a], entries[i].point[a]);
+      }
+    }
+    cell.begin = begin;
+    cell.end = end;
+    cell.left = cell.right = -1;
+    cells.push_back(cell);
+    if (end - begin <= LeafSize)
+      return index;
+
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+    {
+      if (cell.high[a] - cell.low[a] > cell.high[axis] - cell.low[axis])
+        axis = a;
+    }
+    int middle = begin + (end - begin) / 2;
+    nth_element(entries.begin() + begin, entries.begin() + middle, entries.begin() + end, [axis](const Entry &a, const Entry &b)
+                { return a.point[axis] < b.point[axis]; });
+    int left = buildCell(entries, begin, middle);
+    int right = buildCell(entries, middle, end);
+    cells[index].left = left;
+    cells[index].right = right;
+    return index;
+  }
+
+  // Squared distance from the query to the nearest and farthest point of a cell
+  double nearestInCell(const Cell &cell, const double *query)
+  {
+    double sum = 0;
+    for (int a = 0; a < 3; a++)
+    {
+      double gap = max({cell.low[a] - query[a], query[a] - cell.high[a], 0.0});
+      sum += gap * gap;
+    }
+    return sum;
+  }
+
+  double farthestInCell(const Cell &cell, const double *query)
+  {
+    double sum = 0;
+    for (int a = 0; a < 3; a++)
+    {
+      double gap = max(query[a] - cell.low[a], cell.high[a] - query[a]);
+      sum += gap * gap;
+    }
+    return sum;
+  }
+
+  double squaredDistance(int i, const double *query)
+  {
+    double dx = pointX[i] - query[0], dy = pointY[i] - query[1], dz = pointZ[i] - query[2];
+    return dx * dx + dy * dy + dz * dz;
+  }
+
+  // best is a max-heap of the closest points found so far
+  void searchNearest(int index, const double *query, int k, vector<pair<double, int>> &best)
+  {
+    const Cell &cell = cells[index];
+    if ((int)best.size() == k && nearestInCell(cell, query) > best.front().first)
+      return;
+    if (cell.left == -1)
+    {
+      for (int i = cell.begin; i < cell.end; i++)
+      {
+        pair<double, int> candidate(squaredDistance(i, query), ids[i]);
+        if ((int)best.size() < k)
+        {
+          best.push_back(candidate);
+          push_heap(best.begin(), best.end());
+        }
+        else if (candidate < best.front())
+        {
+          pop_heap(best.begin(), best.end());
+          best.back() = candidate;
+          push_heap(best.begin(), best.end());
+        }
+      }
+      return;
+    }
+    int nearer = cell.left, farther = cell.right;
+    if (nearestInCell(cells[farther], query) < nearestInCell(cells[nearer], query))
+      swap(nearer, farther);
+    searchNearest(nearer, query, k, best);
+    searchNearest(farther, query, k, best);
+  }
+
+  void searchWithin(int index, const double *query, double limit, vector<pair<double, int>> &found)
+  {
+    const Cell &cell = cells[index];
+    if (nearestInCell(cell, query) > limit)
+      return;
+    bool inside = farthestInCell(cell, query) <= limit;
+    if (cell.left == -1 || inside)
+    {
+      for (int i = cell.begin; i < cell.end; i++)
+      {
+        double distance = squaredDistance(i, query);
+        if (inside || distance <= limit)
+          found.push_back({distance, ids[i]});
+      }
+      return;
+    }
+    searchWithin(cell.left, query, limit, found);
+    searchWithin(cell.right, query, limit, found);
+  }
+};
+
+// Disjoint sets with path compression and union by rank
+class UnionFind
+{
+public:
+  UnionFind(int n) : parent(n), rank(n, 0)
+  {
+    for (int i = 0; i < n; i++)
+    {
+      parent[i] = i;
+    }
+  }
+
+  int find(int x)
+  {
+    int root = x;
+    while (parent[root] != root)
+    {
+      root = parent[root];
+    }
+    while (parent[x] != root)
+    {
+      int next = parent[x];
+      parent[x] = root;
+      x = next;
+    }
+    return root;
+  }
+
+  // Root without compressing, safe to call from several threads at once
+  int root(int x)
+  {
+    while (parent[x] != x)
+    {
+      x = parent[x];
+    }
+    return x;
+  }
+
+  // False if a and b were already in the same set
+  bool unite(int a, int b)
+  {
+    a = find(a);
+    b = find(b);
+    if (a == b)
+      return false;
+    if (rank[a] < rank[b])
+      swap(a, b);
+    parent[b] = a;
+    if (rank[a] == rank[b])
+      rank[a]++;
+    return true;
+  }
+
+private:
+  vector<int> parent;
+  vector<int> rank;
+};
+
+// Minimum spanning forest: one tree per connected component, as a list of
+// (u, v, weight) edges and as CSR adjacency (rows sorted by id) for traversal
+struct SpanningForest
+{
+  vector<tuple<int, int, int>> edges;
+  long long totalWeight = 0;
+  int components = 0;
+  vector<int> offsets;
+  vector<int> neighbors;
+  vector<int> weights;
+
+  // liveNodes leaves removed countries out of the component count
+  void buildAdjacency(int numberOfNodes, int liveNodes)
+  {
+    components = liveNodes - edges.size();
+    totalWeight = 0;
+    offsets.assign(numberOfNodes + 1, 0);
+    for (auto &edge : edges)
+    {
+      offsets[get<0>(edge) + 1]++;
+      offsets[get<1>(edge) + 1]++;
+      totalWeight += get<2>(edge);
+    }
+    for (int u = 0; u < numberOfNodes; u++)
+    {
+      offsets[u + 1] += offsets[u];
+    }
+    vector<pair<int, int>> row(2 * edges.size());
+    vector<int> next(offsets.begin(), offsets.end() - 1);
+    for (auto &edge : edges)
+    {
+      row[next[get<0>(edge)]++] = {get<1>(edge), get<2>(edge)};
+      row[next[get<1>(edge)]++] = {get<0>(edge), get<2>(edge)};
+    }
+    neighbors.resize(row.size());
+    weights.resize(row.size());
+    for (int u = 0; u < numberOfNodes; u++)
+    {
+      sort(row.begin() + offsets[u], row.begin() + offsets[u + 1]);
+      for (int e = offsets[u]; e < offsets[u + 1]; e++)
+      {
+        neighbors[e] = row[e].first;
+        weights[e] = row[e].second;
+      }
+    }
+  }
+};
+
+// Output and scratch of a traversal, owned by the caller and reused across
+// calls so repeated traversals allocate nothing. After a traversal order
+// holds the reached nodes in visit order; depth and parent are only valid
+// for those nodes (parent is -1 at the source).
+struct TraversalBuffers
+{
+  vector<int> order;
+  vector<int> depth;
+  vector<int> parent;
+  vector<uint32_t> visited; // visited[v] == epoch once v is reached in this traversal
+  uint32_t epoch = 0;
+  vector<pair<int, int>> stack;     // depth first: (node, next edge to look at)
+  vector<uint64_t> frontier;        // direction optimizing BFS: current level as a bitmap
+  vector<uint64_t> reached;         // and every node reached so far
+  vector<int> component;            // connectedComponents labels
+
+  // Starts a traversal over n nodes: a new epoch marks every node unvisited
+  void start(int n)
+  {
+    if ((int)visited.size() != n)
+    {
+      visited.assign(n, 0);
+      depth.resize(n);
+      parent.resize(n);
+      order.reserve(n);
+      epoch = 0;
+    }
+    if (++epoch == 0)
+    {
+      fill(visited.begin(), visited.end(), 0);
+      epoch = 1;
+    }
+    order.clear();
+  }
+
+  bool seen(int v)
+  {
+    return visited[v] == epoch;
+  }
+
+  void reach(int v, int from, int level)
+  {
+    visited[v] = epoch;
+    parent[v] = from;
+    depth[v] = level;
+    order.push_back(v);
+  }
+};
+
+// Traversals over CSR adjacency (offsets, neighbors), so they serve the
+// graph itself and trees such as a SpanningForest. Each returns the number
+// of nodes reached and never prints.
+
+// Breadth first from source, stopping early once target (if not -1) is
+// reached. Nodes are marked when discovered, so each is queued once, and
+// order itself is the queue.
+int breadthFirst(vector<int> &offsets, vector<int> &neighbors, int source, TraversalBuffers &out, int target = -1)
+{
+  ScopedTimer timer("breadth first", LatencyTraversal);
+  out.start(offsets.size() - 1);
+  out.reach(source, -1, 0);
+  for (size_t head = 0; head < out.order.size() && !(target != -1 && out.seen(target)); head++)
+  {
+    int u = out.order[head];
+    for (int e = offsets[u]; e < offsets[u + 1]; e++)
+    {
+      int v = neighbors[e];
+      if (!out.seen(v))
+        out.reach(v, u, out.depth[u] + 1);
+    }
+  }
+  instrumentation.count(CounterBfsPushes, out.order.size());
+  return out.order.size();
+}
+
+// Labels every node with its connected component (numbered from 0 in order
+// of their lowest id) in out.component, returns the number of components
+int connectedComponents(vector<int> &offsets, vector<int> &neighbors, TraversalBuffers &out)
+{
+  int n = offsets.size() - 1;
+  out.start(n);
+  out.component.resize(n);
+  int components = 0;
+  for (int source = 0; source < n; source++)
+  {
+    if (out.seen(source))
+      continue;
+    size_t head = out.order.size();
+    out.reach(source, -1, 0);
+    for (; head < out.order.size(); head++)
+    {
+      int u = out.order[head];
+      out.component[u] = components;
+      for (int e = offsets[u]; e < offsets[u + 1]; e++)
+      {
+        int v = neighbors[e];
+        if (!out.seen(v))
+          out.reach(v, u, out.depth[u] + 1);
+      }
+    }
+    components++;
+  }
+  return components;
+}
+
+// Depth first from source, neighbours taken from the highest id down. This
+// is the order of the stack traversal that pushes every neighbour in id order
+// and skips visited nodes on pop, but the stack holds one entry per node on
+// the current path instead of one per edge.
+int depthFirst(vector<int> &offsets, vector<int> &neighbors, int source, TraversalBuffers &out)
+{
+  ScopedTimer timer("depth first", LatencyTraversal);
+  out.start(offsets.size() - 1);
+  out.stack.clear();
+  out.reach(source, -1, 0);
+  out.stack.push_back({source, offsets[source + 1] - 1});
+  while (!out.stack.empty())
+  {
+    int u = out.stack.back().first;
+    int &e = out.stack.back().second;
+    while (e >= offsets[u] && out.seen(neighbors[e]))
+    {
+      e--;
+    }
+    if (e < offsets[u])
+    {
+      out.stack.pop_back();
+      continue;
+    }
+    int v = neighbors[e--];
+    out.reach(v, u, out.depth[u] + 1);
+    out.stack.push_back({v, offsets[v + 1] - 1});
+  }
+  return out.order.size();
+}
+
+// Level synchronous BFS that switches between top-down steps (scan the
+// frontier's edges) and bottom-up steps (every unreached node looks for a
+// parent in the frontier bitmap, stopping at the first) using Beamer's
+// heuristic: go bottom-up once a growing frontier's edges exceed 1/14 of the
+// edges of unreached nodes, back top-down once a shrinking frontier drops
+// below n / 24 nodes. Depths match breadthFirst; parents may differ, and
+// order lists each level by id after a bottom-up step. Adjacency must be
+// symmetric. Pays off on low diameter graphs; on long thin ones
+// breadthFirst is cheaper.
+int directionOptimizingBfs(vector<int> &offsets, vector<int> &neighbors, int source, TraversalBuffers &out)
+{
+  ScopedTimer timer("direction optimizing bfs", LatencyTraversal);
+  int n = offsets.size() - 1;
+  out.start(n);
+  int words = (n + 63) / 64;
+  out.frontier.assign(words, 0);
+  out.reached.assign(words, 0);
+  out.reach(source, -1, 0);
+  out.reached[source / 64] |= 1ULL << (source % 64);
+  long long unexploredEdges = offsets[n] - (offsets[source + 1] - offsets[source]);
+  long long frontierEdges = offsets[source + 1] - offsets[source];
+  bool bottomUp = false;
+  size_t levelBegin = 0;
+  long long previousSize = 0;
+  for (int level = 0; levelBegin < out.order.size(); level++)
+  {
+    size_t levelEnd = out.order.size();
+    long long frontierSize = levelEnd - levelBegin;
+    bool growing = frontierSize > previousSize;
+    previousSize = frontierSize;
+    if (!bottomUp && growing && frontierEdges > unexploredEdges / 14)
+      bottomUp = true;
+    else if (bottomUp && !growing && frontierSize < n / 24)
+      bottomUp = false;
+    frontierEdges = 0;
+    if (bottomUp)
+    {
+      fill(out.frontier.begin(), out.frontier.end(), 0);
+      for (size_t i = levelBegin; i < levelEnd; i++)
+      {
+        out.frontier[out.order[i] / 64] |= 1ULL << (out.order[i] % 64);
+      }
+      // Visit unreached nodes a bitmap word at a time, skipping reached blocks
+      for (int w = 0; w < words; w++)
+      {
+        uint64_t unreached = ~out.reached[w];
+        if (w == words - 1 && n % 64 != 0)
+          unreached &= (1ULL << (n % 64)) - 1;
+        for (; unreached != 0; unreached &= unreached - 1)
+        {
+          int v = 64 * w + __builtin_ctzll(unreached);
+          for (int e = offsets[v]; e < offsets[v + 1]; e++)
+          {
+            int u = neighbors[e];
+            if (out.frontier[u / 64] >> (u % 64) & 1)
+            {
+              out.reach(v, u, level + 1);
+              out.reached[w] |= 1ULL << (v % 64);
+              frontierEdges += offsets[v + 1] - offsets[v];
+              break;
+            }
+          }
+        }
+      }
+    }
+    else
+    {
+      for (size_t i = levelBegin; i < levelEnd; i++)
+      {
+        int u = out.order[i];
+        for (int e = offsets[u]; e < offsets[u + 1]; e++)
+        {
+          int v = neighbors[e];
+          if (!out.seen(v))
+          {
+            out.reach(v, u, level + 1);
+            out.reached[v / 64] |= 1ULL << (v % 64);
+            frontierEdges += offsets[v + 1] - offsets[v];
+          }
+        }
+      }
+    }
+    unexploredEdges -= frontierEdges;
+    levelBegin = levelEnd;
+  }
+  return out.order.size();
+}
+
+// Weight types the search kernels below accept. Path lengths (Distance) add
+// up in 32 bits for 16 bit weights and in the weight type otherwise;
+// infinity marks an unreached node (INT_MAX for int, as everywhere else) and
+// add saturates at it, so unsigned and narrow types never wrap. fromKm turns
+// a haversine distance into a weight, whole km for integer types.
+template <typename Weight>
+struct WeightTraits
+{
+  typedef conditional_t<is_integral_v<Weight> && sizeof(Weight) < 4, uint32_t, Weight> Distance;
+  static constexpr Distance infinity = numeric_limits<Distance>::has_infinity ? numeric_limits<Distance>::infinity() : numeric_limits<Distance>::max();
+
+  static constexpr Distance add(Distance distance, Weight weight)
+  {
+    if constexpr (is_integral_v<Distance>)
+      return distance >= infinity - (Distance)weight ? infinity : distance + (Distance)weight;
+    else
+      return distance + weight;
+  }
+
+  static constexpr Weight fromKm(double km)
+  {
+    if constexpr (is_integral_v<Weight>)
+      return (Weight)min(km, (double)numeric_limits<Weight>::max() - 1);
+    else
+      return (Weight)km;
+  }
+};
+
+// Node id types: none is the "no parent" value (-1 for signed ids, the
+// largest value for unsigned ones) and maxNodes the most nodes a graph with
+// these ids can have
+template <typename Id>
+struct IdTraits
+{
+  static constexpr Id none = is_signed_v<Id> ? (Id)-1 : numeric_limits<Id>::max();
+  static constexpr size_t maxNodes = numeric_limits<Id>::max();
+};
+
+// CSR adjacency seen through raw pointers, so the kernels below serve Graph
+// (int weights and ids) and every WeightedCsr width alike
+template <typename Weight, typename Id>
+struct CsrView
+{
+  int numberOfNodes;
+  const int *offsets;
+  const Id *neighbors;
+  const Weight *weights;
+};
+
+// Caller owned working memory for Graph::primTree, reused between calls.
+// Tree node v joins through parent[v] at cost distance[v]; order lists the
+// nodes in the order they joined. As in TraversalBuffers, stamps equal to
+// epoch mark the nodes this run has touched, so a new run clears nothing.
+template <typename Weight, typename Id>
+struct BasicPrimBuffers
+{
+  vector<Id> parent;
+  vector<Weight> distance;
+  vector<Id> order;
+  vector<uint32_t> keyed;  // keyed[v] == epoch once v has a distance this run
+  vector<uint32_t> inTree; // inTree[v] == epoch once v has joined
+  uint32_t epoch = 0;
+  vector<pair<Weight, Id>> heap; // (key, ~id)
+
+  void start(int n)
+  {
+    if ((int)keyed.size() != n)
+    {
+      keyed.assign(n, 0);
+      inTree.assign(n, 0);
+      parent.resize(n);
+      distance.resize(n);
+      order.reserve(n);
+      epoch = 0;
+    }
+    if (++epoch == 0)
+    {
+      fill(keyed.begin(), keyed.end(), 0);
+      fill(inTree.begin(), inTree.end(), 0);
+      epoch = 1;
+    }
+    order.clear();
+    heap.clear();
+  }
+};
+typedef BasicPrimBuffers<int, int> PrimBuffers;
+
+// Caller owned working memory for the point to point searches (Dijkstra, A*,
+// ALT), reused between calls. distance and parent hold for the nodes whose
+// reached stamp equals epoch, distanceTo reads infinity for the rest.
+template <typename Weight, typename Id>
+struct BasicPathBuffers
+{
+  typedef typename WeightTraits<Weight>::Distance Distance;
+  vector<Distance> distance;
+  vector<Id> parent;
+  vector<uint32_t> reached;
+  uint32_t epoch = 0;
+  vector<tuple<Distance, Distance, Id>> heap; // (estimated total, distance so far, node)
+
+  void start(int n)
+  {
+    if ((int)reached.size() != n)
+    {
+      reached.assign(n, 0);
+      distance.resize(n);
+      parent.resize(n);
+      epoch = 0;
+    }
+    if (++epoch == 0)
+    {
+      fill(reached.begin(), reached.end(), 0);
+      epoch = 1;
+    }
+    heap.clear();
+  }
+
+  Distance distanceTo(int v)
+  {
+    return reached[v] == epoch ? distance[v] : WeightTraits<Weight>::infinity;
+  }
+
+  void reach(int v, Distance dist, Id from)
+  {
+    reached[v] = epoch;
+    distance[v] = dist;
+    parent[v] = from;
+  }
+};
+typedef BasicPathBuffers<int, int> PathBuffers;
+
+// Search from source ordered by distance + bound(node), stopping once
+// destination is settled. bound must never overestimate the distance left:
+// returning 0 gives Dijkstra, a geometric or landmark bound gives A* / ALT.
+// Returns the number of nodes settled.
+template <typename Weight, typename Id, typename Bound>
+int bestFirstSearch(CsrView<Weight, Id> graph, Id source, Id destination, Bound bound, BasicPathBuffers<Weight, Id> &out)
+{
+  typedef WeightTraits<Weight> Traits;
+  typedef typename Traits::Distance Distance;
+  out.start(graph.numberOfNodes);
+  auto later = greater<tuple<Distance, Distance, Id>>();
+
+  int settled = 0;
+  uint64_t relaxed = 0;
+  out.reach(source, 0, IdTraits<Id>::none);
+  out.heap.push_back(make_tuple((Distance)bound(source), (Distance)0, source));
+  while (!out.heap.empty())
+  {
+    pop_heap(out.heap.begin(), out.heap.end(), later);
+    Distance dist = get<1>(out.heap.back());
+    Id vertex = get<2>(out.heap.back());
+    out.heap.pop_back();
+    if (dist > out.distance[vertex])
+      continue;
+    settled++;
+    if (vertex == destination)
+      break;
+    relaxed += graph.offsets[vertex + 1] - graph.offsets[vertex];
+    for (int e = graph.offsets[vertex]; e < graph.offsets[vertex + 1]; e++)
+    {
+      Id j = graph.neighbors[e];
+      Distance candidate = Traits::add(dist, graph.weights[e]);
+      if (candidate < out.distanceTo(j))
+      {
+        out.reach(j, candidate, vertex);
+        out.heap.push_back(make_tuple(Traits::add(candidate, bound(j)), candidate, j));
+        push_heap(out.heap.begin(), out.heap.end(), later);
+      }
+    }
+  }
+  instrumentation.count(CounterPathSettled, settled);
+  instrumentation.count(CounterPathRelaxed, relaxed);
+  return settled;
+}
+
+// Prim's algorithm over source's part of the graph with a binary heap. Among
+// equal keys the higher id joins first (heap entries hold ~id), as in the
+// array scan this replaced, so the tree comes out the same. Returns the
+// number of tree nodes.
+template <typename Weight, typename Id>
+int primKernel(CsrView<Weight, Id> graph, Id source, BasicPrimBuffers<Weight, Id> &out)
+{
+  uint64_t relaxed = 0;
+  out.start(graph.numberOfNodes);
+  uint32_t epoch = out.epoch;
+  auto later = greater<pair<Weight, Id>>();
+  out.keyed[source] = epoch;
+  out.distance[source] = 0;
+  out.parent[source] = IdTraits<Id>::none;
+  out.heap.push_back({(Weight)0, (Id)~source});
+  while (!out.heap.empty())
+  {
+    pop_heap(out.heap.begin(), out.heap.end(), later);
+    Id vertex = (Id)~out.heap.back().second;
+    out.heap.pop_back();
+    if (out.inTree[vertex] == epoch)
+      continue;
+    out.inTree[vertex] = epoch;
+    out.order.push_back(vertex);
+    relaxed += graph.offsets[vertex + 1] - graph.offsets[vertex];
+    for (int e = graph.offsets[vertex]; e < graph.offsets[vertex + 1]; e++)
+    {
+      Id j = graph.neighbors[e];
+      Weight weight = graph.weights[e];
+      if (out.inTree[j] != epoch && (out.keyed[j] != epoch || weight < out.distance[j]))
+      {
+        out.keyed[j] = epoch;
+        out.distance[j] = weight;
+        out.parent[j] = vertex;
+        out.heap.push_back({weight, (Id)~j});
+        push_heap(out.heap.begin(), out.heap.end(), later);
+      }
+    }
+  }
+  instrumentation.count(CounterPrimSettled, out.order.size());
+  instrumentation.count(CounterPrimRelaxed, relaxed);
+  return out.order.size();
+}
+
+// Working memory for one query at a time: every per query buffer the graph
+// algorithms use, sized on first use and then reused. threadScratch() gives
+// each thread its own, so once warmed up queries make no heap allocations
+// (countries --check-allocations verifies this).
+struct QueryScratch
+{
+  PathBuffers path;
+  PrimBuffers tree;
+  TraversalBuffers traversal;
+  NameSearch::Scratch search;
+  PathResult result;
+};
+
+QueryScratch &threadScratch()
+{
+  thread_local QueryScratch scratch;
+  return scratch;
+}
+
+// Adjacency and derived columns of a Graph as restored from a snapshot
+struct GraphArrays
+{
+  vector<int> offsets;
+  vector<int> neighbors;
+  vector<int> weights;
+  vector<double> pointX, pointY, pointZ;
+  double heuristicScale = 1.0;
+  vector<int> nameSlots, codeSlots;
+  vector<uint32_t> nameTags, codeTags;
+};
+
+class Graph
+{
+public:
+  NodeTable &nodes;
+  int numberOfNodes;
+  // Compressed sparse row adjacency: the neighbours of node u are
+  // neighbors[offsets[u]] .. neighbors[offsets[u + 1] - 1], sorted by id,
+  // with the matching edge costs in weights
+  vector<int> offsets;
+  vector<int> neighbors;
+  vector<int> weights;
+  CountryIndex nameIndex;
+  CountryIndex codeIndex;
+  // Substring and typo tolerant name search, empty until buildSearchIndex
+  NameSearch nameSearch;
+  // Precomputed all pairs table, used by shortestPath once it matches this graph
+  DistanceTable allPairs;
+  // Optional contraction hierarchy, shortestPath hands queries to it once built
+  ContractionHierarchy hierarchy;
+  // Distances from each ALT landmark to every node, empty until buildLandmarks
+  vector<vector<int>> landmarkDistance;
+  // Country positions in 3D and the largest factor their chord distance can be
+  // scaled by while staying a lower bound on every edge weight
+  vector<double> pointX, pointY, pointZ;
+  double heuristicScale;
+  // k-d tree over those points, empty until buildSpatialIndex
+  SpatialIndex spatialIndex;
+  // Set by updates that the hierarchy or landmarks cannot absorb, they are
+  // rebuilt the next time a query needs them
+  bool hierarchyStale = false;
+  bool landmarksStale = false;
+  // Minimum spanning forest, see spanningForest
+  SpanningForest forest;
+  bool forestStale = true;
+  // Bumped by every update: topologyRevision when borders or countries change
+  // (paths), dataRevision when anything a filter reads does
+  uint64_t topologyRevision = 0;
+  uint64_t dataRevision = 0;
+  // Rows edited by updates since the CSR arrays were last compacted, see
+  // setEntry: pendingRow[u] indexes pendingRows, -1 for rows still as stored
+  struct PendingRow
+  {
+    vector<int> neighbors;
+    vector<int> weights;
+  };
+  vector<int> pendingRow;
+  vector<PendingRow> pendingRows;
+  int updateDepth = 0;
+  bool adjacencyEdited = false;
+  // Inverse of nodes.ids, see countryWithId, and whether it is not the identity
+  vector<int> nodeOfId;
+  bool renumbered = false;
+  // Graph over adjacency and indexes that are already built, taken over from arrays
+  Graph(NodeTable &nodes, GraphArrays &arrays) : nodes(nodes)
+  {
+    ScopedTimer timer("adopt snapshot arrays");
+    numberOfNodes = nodes.size();
+    nameIndex.adopt(arrays.nameSlots, arrays.nameTags, false);
+    codeIndex.adopt(arrays.codeSlots, arrays.codeTags, true);
+    offsets.swap(arrays.offsets);
+    neighbors.swap(arrays.neighbors);
+    weights.swap(arrays.weights);
+    pointX.swap(arrays.pointX);
+    pointY.swap(arrays.pointY);
+    pointZ.swap(arrays.pointZ);
+    heuristicScale = arrays.heuristicScale;
+    indexIds();
+  }
+  Graph(NodeTable &nodes, vector<tuple<int, int, int>> &weightedEdges) : nodes(nodes)
+  {
+    ScopedTimer timer("build graph");
+    numberOfNodes = nodes.size();
+    indexIds();
+    nameIndex.build(nodes, false);
+    codeIndex.build(nodes, true);
+
+    // Count the degree of every node, the graph is undirected so each edge is stored both ways
+    vector<int> degree(numberOfNodes + 1, 0);
+    for (const auto &edge : weightedEdges)
+    {
+      degree[get<0>(edge)]++;
+      if (get<0>(edge) != get<1>(edge))
+        degree[get<1>(edge)]++;
+    }
+    offsets.assign(numberOfNodes + 1, 0);
+    for (int i = 0; i < numberOfNodes; i++)
+    {
+      offsets[i + 1] = offsets[i] + degree[i];
+    }
+
+    // Scatter the edges into their rows
+    vector<pair<int, int>> row(offsets[numberOfNodes]);
+    vector<int> next(offsets.begin(), offsets.end() - 1);
+    for (const auto &edge : weightedEdges)
+    {
+      int from = get<0>(edge);
+      int to = get<1>(edge);
+      int cost = get<2>(edge);
+      row[next[from]++] = make_pair(to, cost);
+      if (from != to)
+        row[next[to]++] = make_pair(from, cost);
+    }
+
+    // Sort every row by neighbour id and drop duplicate edges (A lists B and B lists A)
+    neighbors.reserve(row.size());
+    weights.reserve(row.size());
+    int start = 0;
+    for (int i = 0; i < numberOfNodes; i++)
+    {
+      int end = offsets[i + 1];
+      sort(row.begin() + start, row.begin() + end);
+      offsets[i] = neighbors.size();
+      for (int e = start; e < end; e++)
+      {
+        if (e > start && row[e].first == row[e - 1].first)
+          continue;
+        neighbors.push_back(row[e].first);
+        weights.push_back(row[e].second);
+      }
+      start = end;
+    }
+    offsets[numberOfNodes] = neighbors.size();
+
+    // Points on a sphere of the earth's radius, chord lengths between them are in km
+    pointX.resize(numberOfNodes);
+    pointY.resize(numberOfNodes);
+    pointZ.resize(numberOfNodes);
+    for (int i = 0; i < numberOfNodes; i++)
+    {
+      surfacePoint(nodes.latitudes[i], nodes.longitudes[i], pointX[i], pointY[i], pointZ[i]);
+    }
+    heuristicScale = 1.0;
+    for (int u = 0; u < numberOfNodes; u++)
+    {
+      for (int e = offsets[u]; e < offsets[u + 1]; e++)
+      {
+        double dx = pointX[u] - pointX[neighbors[e]], dy = pointY[u] - pointY[neighbors[e]], dz = pointZ[u] - pointZ[neighbors[e]];
+        double chord = sqrt(dx * dx + dy * dy + dz * dz);
+        if (chord > 0)
+          heuristicScale = min(heuristicScale, weights[e] / chord);
+      }
+    }
+  }
+
+  // The adjacency for the templated search kernels
+  CsrView<int, int> view()
+  {
+    return {numberOfNodes, offsets.data(), neighbors.data(), weights.data()};
+  }
+
+  // One adjacency row, sorted by neighbour id
+  struct Row
+  {
+    const int *neighbors;
+    const int *weights;
+    int size;
+  };
+
+  // Row u as updates see it: the pending edit of it if there is one,
+  // otherwise its slice of the CSR arrays
+  Row row(int u)
+  {
+    if (u < (int)pendingRow.size() && pendingRow[u] != -1)
+    {
+      PendingRow &pending = pendingRows[pendingRow[u]];
+      return {pending.neighbors.data(), pending.weights.data(), (int)pending.neighbors.size()};
+    }
+    return {neighbors.data() + offsets[u], weights.data() + offsets[u], offsets[u + 1] - offsets[u]};
+  }
+
+  // Cost of the edge between two countries, INT_MAX if they are not connected
+  int edgeWeight(int from, int to)
+  {
+    Row edges = row(from);
+    const int *it = lower_bound(edges.neighbors, edges.neighbors + edges.size, to);
+    if (it == edges.neighbors + edges.size || *it != to)
+      return INT_MAX;
+    return edges.weights[it - edges.neighbors];
+  }
+
+  // FNV-1a hash of the adjacency arrays, identifies the graph saved tables belong to
+  uint64_t adjacencyChecksum()
+  {
+    uint64_t hash = 14695981039346656037ULL;
+    for (vector<int> *column : {&offsets, &neighbors, &weights})
+    {
+      for (int value : *column)
+      {
+        hash = (hash ^ (uint32_t)value) * 1099511628211ULL;
+      }
+    }
+    return hash;
+  }
+
+  // Bytes held by the adjacency arrays
+  size_t adjacencyBytes()
+  {
+    return (offsets.capacity() + neighbors.capacity() + weights.capacity()) * sizeof(int);
+  }
+
+  void displayCountry(int countryId)
+  {
+    cout << nodes.ids[countryId] << ". " << nodes.name(countryId) << " (" << nodes.code(countryId) << ")" << endl;
+    cout << "Population: " << nodes.populations[countryId] << endl;
+    cout << "Area in KM square: " << nodes.areas[countryId] << endl;
+    // Neighbours by loaded id, the order of the row when the graph is not renumbered
+    vector<int> edges(offsets[countryId + 1] - offsets[countryId]);
+    iota(edges.begin(), edges.end(), offsets[countryId]);
+    sort(edges.begin(), edges.end(), [this](int a, int b)
+         { return nodes.ids[neighbors[a]] < nodes.ids[neighbors[b]]; });
+    for (int e : edges)
+    {
+      cout << nodes.name(neighbors[e]) << ": " << to_string(weights[e]) << "km -- ";
+    }
+    cout << "N/A" << endl
+         << endl;
+  }
+
+  // Listed by id, which stays the CSV order when the graph was renumbered
+  void displayCountries()
+  {
+    for (int node : nodeOfId)
+    {
+      if (node != -1 && nodes.live(node))
+        displayCountry(node);
+    }
+  }
+
+  void buildSearchIndex()
+  {
+    ScopedTimer timer("build search index");
+    nameSearch.build(nodes);
+  }
+
+  // Ids of the countries whose name contains query, best match first (see
+  // NameSearch::search); builds the search index on first use
+  vector<int> searchCountries(string_view query, int limit = INT_MAX, int maxEdits = 0)
+  {
+    if (!nameSearch.built())
+      buildSearchIndex();
+    ScopedTimer timer("search", LatencySearch);
+    return nameSearch.search(query, limit, maxEdits);
+  }
+
+  // Same with caller owned scratch, for concurrent searches once the index is built
+  vector<int> searchCountries(string_view query, int limit, int maxEdits, NameSearch::Scratch &scratch)
+  {
+    ScopedTimer timer("search", LatencySearch);
+    return nameSearch.search(query, limit, maxEdits, scratch);
+  }
+
+  void indexIds()
+  {
+    nodeOfId.assign(numberOfNodes, -1);
+    renumbered = false;
+    for (int v = 0; v < numberOfNodes; v++)
+    {
+      if (nodes.ids[v] >= (int)nodeOfId.size())
+        nodeOfId.resize(nodes.ids[v] + 1, -1);
+      nodeOfId[nodes.ids[v]] = v;
+      renumbered |= nodes.ids[v] != v;
+    }
+  }
+
+  // Node of the country whose NodeTable id is id (its CSV row, kept through
+  // renumberCountries), -1 if there is none
+  int countryWithId(int id)
+  {
+    return id >= 0 && id < (int)nodeOfId.size() ? nodeOfId[id] : -1;
+  }
+
+  // Looks a country up by exact name, or failing that by its code
+  int findCountry(string_view key)
+  {
+    int id = nameIndex.find(nodes, key);
+    return id != -1 ? id : codeIndex.find(nodes, key);
+  }
+
+  // Countries matching filter, queued by population and by area
+  vector<PriorityQueue> filterCountries(RangeFilter &filter)
+  {
+    vector<int> selected = selectCountries(filter);
+    PriorityQueue populationq(nodes, 0);
+    PriorityQueue areaq(nodes, 1);
+    populationq.fill(selected);
+    areaq.fill(selected);
+    return {populationq, areaq};
+  }
+
+  // Ids of the countries matching filter, in id order
+  vector<int> selectCountries(RangeFilter &filter)
+  {
+    ScopedTimer timer("filter", LatencyFilter);
+    vector<uint64_t> mask = nodes.select(filter);
+    vector<int> selected;
+    for (int w = 0; w < (int)mask.size(); w++)
+    {
+      for (uint64_t bits = mask[w]; bits != 0; bits &= bits - 1)
+      {
+        selected.push_back(64 * w + __builtin_ctzll(bits));
+      }
+    }
+    return selected;
+  }
+
+  void bfsTraversal(int vertex)
+  {
+    printBfs(offsets, neighbors, vertex);
+  }
+  void dfsTraversal(int vertex)
+  {
+    printDfs(offsets, neighbors, vertex);
+  }
+  // Copy of neighbors with every row in loaded id order, what the printed
+  // traversals walk on a renumbered graph so they visit countries as the
+  // graph built in CSV order would
+  vector<int> neighborsByLoadedId(vector<int> &offsets, vector<int> &neighbors)
+  {
+    vector<int> sorted(neighbors);
+    for (size_t u = 0; u + 1 < offsets.size(); u++)
+    {
+      sort(sorted.begin() + offsets[u], sorted.begin() + offsets[u + 1], [this](int a, int b)
+           { return nodes.ids[a] < nodes.ids[b]; });
+    }
+    return sorted;
+  }
+  // Prints names in BFS / DFS order over any CSR adjacency on these nodes
+  void printBfs(vector<int> &offsets, vector<int> &neighbors, int vertex)
+  {
+    if (vertex >= numberOfNodes || vertex < 0)
+    {
+      return;
+    }
+    TraversalBuffers &traversal = threadScratch().traversal;
+    vector<int> byLoadedId;
+    if (renumbered)
+      byLoadedId = neighborsByLoadedId(offsets, neighbors);
+    ::breadthFirst(offsets, renumbered ? byLoadedId : neighbors, vertex, traversal);
+    printOrder(traversal.order);
+  }
+  void printDfs(vector<int> &offsets, vector<int> &neighbors, int vertex)
+  {
+    if (vertex >= numberOfNodes || vertex < 0)
+    {
+      return;
+    }
+    TraversalBuffers &traversal = threadScratch().traversal;
+    vector<int> byLoadedId;
+    if (renumbered)
+      byLoadedId = neighborsByLoadedId(offsets, neighbors);
+    ::depthFirst(offsets, renumbered ? byLoadedId : neighbors, vertex, traversal);
+    printOrder(traversal.order);
+  }
+  void printOrder(vector<int> &order)
+  {
+    for (int vertex : order)
+    {
+      cout << nodes.name(vertex) << " -> ";
+    }
+    cout << " N/A " << endl;
+  }
+
+  int breadthFirst(int source, TraversalBuffers &out)
+  {
+    return ::breadthFirst(offsets, neighbors, source, out);
+  }
+  int depthFirst(int source, TraversalBuffers &out)
+  {
+    return ::depthFirst(offsets, neighbors, source, out);
+  }
+  int directionOptimizingBfs(int source, TraversalBuffers &out)
+  {
+    return ::directionOptimizingBfs(offsets, neighbors, source, out);
+  }
+  int connectedComponents(TraversalBuffers &out)
+  {
+    return ::connectedComponents(offsets, neighbors, out);
+  }
+  // Fewest borders crossed from source to target, -1 if unreachable
+  int hopDistance(int source, int target, TraversalBuffers &out)
+  {
+    ::breadthFirst(offsets, neighbors, source, out, target);
+    return out.seen(target) ? out.depth[target] : -1;
+  }
+  void printPrims(PrimBuffers &prim, int source)
+  {
+    SpanningForest tree;
+    for (int i = 0; i < numberOfNodes; i++)
+    {
+      if (prim.inTree[i] == prim.epoch && prim.parent[i] != -1)
+      {
+        tree.edges.push_back(make_tuple(i, prim.parent[i], prim.distance[i]));
+      }
+    }
+    tree.buildAdjacency(numberOfNodes, nodes.liveCount());
+    cout << "Press 0 to display minimum spanning tree with bfs traversal otherwise, press 1 to display in dfs traversal: ";
+    int option;
+    cin >> option;
+    cout << endl;
+    if (option == 0)
+    {
+      printBfs(tree.offsets, tree.neighbors, source);
+    }
+    else if (option == 1)
+    {
+      printDfs(tree.offsets, tree.neighbors, source);
+    }
+  }
+
+  void printDijkstra(PathResult &result)
+  {
+    string path = "";
+    cout << endl
+         << "Source :: ";
+
+    for (int country : result.path)
+    {
+      path += string(nodes.name(country)) + "  ";
+    }
+    if (result.path.size() <= 1)
+    {
+      cout << "The countries are not accessible by road ";
+    }
+    else
+    {
+      cout << path;
+    }
+    cout << ":: Destination" << endl;
+    if (result.distance != INT_MAX)
+      cout << "Total Distance: " << result.distance << " KM" << endl;
+  }
+  // Heap based Dijkstra from source that stops once every node in targets
+  // (sorted) has been settled, or runs to completion when targets is empty
+  // Returns the number of nodes settled
+  int dijkstraSearch(int source, vector<int> &targets, vector<int> &distance, vector<int> &parent)
+  {
+    distance.assign(numberOfNodes, INT_MAX);
+    parent.assign(numberOfNodes, -1);
+    priority_queue<pair<int, int>, vector<pair<int, int>>, greater<pair<int, int>>> heap;
+
+    int remaining = targets.size();
+    int settled = 0;
+    uint64_t relaxed = 0;
+    distance[source] = 0;
+    heap.push(make_pair(0, source));
+    while (!heap.empty())
+    {
+      int dist = heap.top().first;
+      int vertex = heap.top().second;
+      heap.pop();
+      // Stale entry, the node was already settled with a shorter distance
+      if (dist > distance[vertex])
+        continue;
+      settled++;
+      if (remaining > 0 && binary_search(targets.begin(), targets.end(), vertex) && --remaining == 0)
+        break;
+
+      relaxed += offsets[vertex + 1] - offsets[vertex];
+      for (int e = offsets[vertex]; e < offsets[vertex + 1]; e++)
+      {
+        int j = neighbors[e];
+        if (dist + weights[e] < distance[j])
+        {
+          distance[j] = dist + weights[e];
+          parent[j] = vertex;
+          heap.push(make_pair(distance[j], j));
+        }
+      }
+    }
+    instrumentation.count(CounterPathSettled, settled);
+    instrumentation.count(CounterPathRelaxed, relaxed);
+    return settled;
+  }
+
+  // Lower bound on the road distance from vertex to destination. The straight
+  // (chord) distance through the earth is a metric, so scaled by the smallest
+  // weight/chord ratio over all edges it never overestimates, even though weights
+  // are truncated to whole km. With landmarks, the triangle inequality bound
+  // |d(L, t) - d(L, v)| is used too.
+  int distanceBound(int vertex, int destination, bool useLandmarks)
+  {
+    double dx = pointX[vertex] - pointX[destination];
+    double dy = pointY[vertex] - pointY[destination];
+    double dz = pointZ[vertex] - pointZ[destination];
+    int bound = (int)(heuristicScale * sqrt(dx * dx + dy * dy + dz * dz));
+    if (!useLandmarks)
+      return bound;
+    for (auto &fromLandmark : landmarkDistance)
+    {
+      int toVertex = fromLandmark[vertex], toDestination = fromLandmark[destination];
+      if (toVertex != INT_MAX && toDestination != INT_MAX)
+        bound = max(bound, abs(toDestination - toVertex));
+    }
+    return bound;
+  }
+
+  // A* from source to destination ordered by distance + distanceBound, returns the number of nodes settled
+  int goalDirectedSearch(int source, int destination, bool useLandmarks, PathBuffers &out)
+  {
+    if (useLandmarks && landmarksStale)
+      buildLandmarks(landmarkDistance.size());
+    return bestFirstSearch(view(), source, destination, [&](int vertex)
+                           { return distanceBound(vertex, destination, useLandmarks); }, out);
+  }
+
+  PathResult aStar(int source, int destination)
+  {
+    PathResult result;
+    PathBuffers &buffers = threadScratch().path;
+    goalDirectedSearch(source, destination, false, buffers);
+    pathTo(source, destination, buffers, result);
+    return result;
+  }
+
+  // ALT: A* with landmark bounds, needs buildLandmarks first
+  PathResult alt(int source, int destination)
+  {
+    PathResult result;
+    PathBuffers &buffers = threadScratch().path;
+    goalDirectedSearch(source, destination, true, buffers);
+    pathTo(source, destination, buffers, result);
+    return result;
+  }
+
+  // Picks landmarks by farthest point selection and stores the distance from each to every node
+  void buildLandmarks(int count)
+  {
+    ScopedTimer timer("build landmarks");
+    landmarkDistance.clear();
+    landmarksStale = false;
+    if (numberOfNodes == 0)
+      return;
+    vector<int> targets, parent;
+    vector<int> closest(numberOfNodes, INT_MAX);
+    int landmark = 0;
+    for (int l = 0; l < count && l < numberOfNodes; l++)
+    {
+      landmarkDistance.push_back({});
+      dijkstraSearch(landmark, targets, landmarkDistance.back(), parent);
+      // The next landmark is the node farthest from all chosen so far, preferring unreached ones
+      int farthest = -1;
+      for (int v = 0; v < numberOfNodes; v++)
+      {
+        closest[v] = min(closest[v], landmarkDistance.back()[v]);
+        if (closest[v] > 0 && (farthest == -1 || closest[v] > closest[farthest]))
+          farthest = v;
+      }
+      if (farthest == -1)
+        break;
+      landmark = farthest;
+    }
+  }
+
+  PathResult pathTo(int source, int destination, const vector<int> &distance, const vector<int> &parent)
+  {
+    PathResult result = {source, destination, distance[destination], {}};
+    if (result.distance == INT_MAX)
+      return result;
+    for (int vertex = destination; vertex != -1; vertex = parent[vertex])
+    {
+      result.path.push_back(vertex);
+    }
+    reverse(result.path.begin(), result.path.end());
+    return result;
+  }
+
+  // Path found by goalDirectedSearch, into result reusing its path's memory
+  void pathTo(int source, int destination, PathBuffers &buffers, PathResult &result)
+  {
+    result.source = source;
+    result.destination = destination;
+    result.distance = buffers.distanceTo(destination);
+    result.path.clear();
+    if (result.distance == INT_MAX)
+      return;
+    for (int vertex = destination; vertex != -1; vertex = buffers.parent[vertex])
+    {
+      result.path.push_back(vertex);
+    }
+    reverse(result.path.begin(), result.path.end());
+  }
+
+  PathResult shortestPath(int source, int destination)
+  {
+    ScopedTimer timer("shortest path", LatencyPath);
+    if (allPairs.numberOfNodes == numberOfNodes)
+      return allPairs.path(source, destination);
+    if (hierarchyStale)
+      buildHierarchy();
+    if (hierarchy.built())
+      return hierarchy.query(source, destination);
+    return alt(source, destination);
+  }
+
+  // shortestPath for concurrent readers of a graph that is not being updated:
+  // the caller supplies the search buffers and result, so nothing is
+  // allocated once they have grown, and the contraction hierarchy, which
+  // keeps its own, is left out
+  void shortestPath(int source, int destination, PathBuffers &buffers, PathResult &result)
+  {
+    ScopedTimer timer("shortest path", LatencyPath);
+    if (allPairs.numberOfNodes == numberOfNodes)
+      allPairs.path(source, destination, result);
+    else
+    {
+      goalDirectedSearch(source, destination, true, buffers);
+      pathTo(source, destination, buffers, result);
+    }
+  }
+
+  // Answers many (source, destination) queries, running one search per distinct
+  // source. Results come back in the same order as the queries.
+  vector<PathResult> shortestPaths(vector<pair<int, int>> &queries)
+  {
+    vector<PathResult> results(queries.size());
+    vector<int> order(queries.size());
+    for (int i = 0; i < (int)order.size(); i++)
+    {
+      order[i] = i;
+    }
+    sort(order.begin(), order.end(), [&](int a, int b)
+         { return queries[a].first < queries[b].first; });
+
+    vector<int> distance, parent, targets;
+    int start = 0;
+    while (start < (int)order.size())
+    {
+      int source = queries[order[start]].first;
+      int end = start;
+      targets.clear();
+      while (end < (int)order.size() && queries[order[end]].first == source)
+      {
+        targets.push_back(queries[order[end]].second);
+        end++;
+      }
+      sort(targets.begin(), targets.end());
+      targets.erase(unique(targets.begin(), targets.end()), targets.end());
+
+      dijkstraSearch(source, targets, distance, parent);
+      for (int i = start; i < end; i++)
+      {
+        results[order[i]] = pathTo(source, queries[order[i]].second, distance, parent);
+      }
+      start = end;
+    }
+    return results;
+  }
+
+  // Each undirected edge once (u < v, self loops left out) with its weight
+  void undirectedEdges(vector<int> &from, vector<int> &to, vector<int> &cost)
+  {
+    from.clear();
+    to.clear();
+    cost.clear();
+    for (int u = 0; u < numberOfNodes; u++)
+    {
+      for (int e = offsets[u]; e < offsets[u + 1]; e++)
+      {
+        if (u < neighbors[e])
+        {
+          from.push_back(u);
+          to.push_back(neighbors[e]);
+          cost.push_back(weights[e]);
+        }
+      }
+    }
+  }
+
+  // Orders edges by weight, then by position in the edge list. Both MST
+  // algorithms break ties this way, so they pick the same forest.
+  static uint64_t edgeOrder(int weight, int edge)
+  {
+    return (uint64_t)((uint32_t)weight ^ 0x80000000u) << 32 | (uint32_t)edge;
+  }
+
+  // Kruskal: edges in increasing order, kept when they join two trees
+  SpanningForest kruskal()
+  {
+    ScopedTimer timer("kruskal");
+    vector<int> from, to, cost;
+    undirectedEdges(from, to, cost);
+    vector<uint64_t> order(from.size());
+    for (size_t e = 0; e < from.size(); e++)
+    {
+      order[e] = edgeOrder(cost[e], e);
+    }
+    sort(order.begin(), order.end());
+    UnionFind sets(numberOfNodes);
+    SpanningForest forest;
+    for (uint64_t key : order)
+    {
+      int e = (uint32_t)key;
+      if (sets.unite(from[e], to[e]))
+      {
+        forest.edges.push_back(make_tuple(from[e], to[e], cost[e]));
+        if ((int)forest.edges.size() == numberOfNodes - 1)
+          break;
+      }
+    }
+    forest.buildAdjacency(numberOfNodes, nodes.liveCount());
+    return forest;
+  }
+
+  // Boruvka: every round each tree takes its cheapest edge to another tree,
+  // at least halving the number of trees. The cheapest edge search runs on
+  // all cores with an atomic minimum per tree; merging is sequential and
+  // touches at most one edge per tree.
+  SpanningForest boruvka()
+  {
+    ScopedTimer timer("boruvka");
+    vector<int> from, to, cost;
+    undirectedEdges(from, to, cost);
+    int n = numberOfNodes;
+    vector<int> component(n);
+    for (int v = 0; v < n; v++)
+    {
+      component[v] = v;
+    }
+    // Edges that still join two different trees
+    vector<int> live(from.size());
+    for (size_t e = 0; e < from.size(); e++)
+    {
+      live[e] = e;
+    }
+    vector<atomic<uint64_t>> cheapest(n);
+    UnionFind sets(n);
+    SpanningForest forest;
+    while (!live.empty())
+    {
+#pragma omp parallel for schedule(static)
+      for (int c = 0; c < n; c++)
+      {
+        cheapest[c].store(UINT64_MAX, memory_order_relaxed);
+      }
+#pragma omp parallel for schedule(static)
+      for (size_t i = 0; i < live.size(); i++)
+      {
+        int e = live[i];
+        uint64_t key = edgeOrder(cost[e], e);
+        for (int c : {component[from[e]], component[to[e]]})
+        {
+          uint64_t current = cheapest[c].load(memory_order_relaxed);
+          while (key < current && !cheapest[c].compare_exchange_weak(current, key, memory_order_relaxed))
+          {
+          }
+        }
+      }
+
+      bool merged = false;
+      for (int c = 0; c < n; c++)
+      {
+        uint64_t key = cheapest[c].load(memory_order_relaxed);
+        if (key == UINT64_MAX)
+          continue;
+        int e = (uint32_t)key;
+        // Both trees of an edge may have picked it, it is added once
+        if (sets.unite(from[e], to[e]))
+        {
+          forest.edges.push_back(make_tuple(from[e], to[e], cost[e]));
+          merged = true;
+        }
+      }
+      if (!merged)
+        break;
+
+#pragma omp parallel for schedule(static)
+      for (int v = 0; v < n; v++)
+      {
+        component[v] = sets.root(v);
+      }
+      live.erase(remove_if(live.begin(), live.end(), [&](int e)
+                           { return component[from[e]] == component[to[e]]; }),
+                 live.end());
+    }
+    forest.buildAdjacency(numberOfNodes, nodes.liveCount());
+    return forest;
+  }
+
+  // Minimum spanning forest, computed with kruskal on first use and then kept
+  // up to date by the update methods below
+  SpanningForest &spanningForest()
+  {
+    if (forestStale)
+    {
+      forest = kruskal();
+      forestStale = false;
+    }
+    return forest;
+  }
+
+  // Incremental updates. Edited adjacency rows are kept aside (setEntry) and
+  // folded back into the CSR arrays in one pass when the update, or a batch
+  // of them between beginUpdates and endUpdates, is done. Whatever was built
+  // over the adjacency is repaired rather than recomputed where that is
+  // cheap: a cheaper or new border repairs all pairs and landmark distances
+  // from its endpoints and may swap one spanning forest edge; a dearer or
+  // removed one searches again only the part of each all pairs tree that
+  // hung below it. The contraction hierarchy, landmarks after a removal, the
+  // name search and the spatial index are only marked out of date and
+  // rebuilt by the next query using them. The revision counters let outside
+  // caches notice.
+
+  // Updates made until the matching endUpdates share one compaction of the
+  // adjacency. Queries must not run in between.
+  void beginUpdates()
+  {
+    updateDepth++;
+  }
+
+  void endUpdates()
+  {
+    if (--updateDepth == 0)
+      compact();
+  }
+
+  // Rebuilds the CSR arrays with the pending rows in place, O(V + E) once per batch
+  void compact()
+  {
+    if (!adjacencyEdited)
+      return;
+    if (!pendingRows.empty())
+    {
+      ScopedTimer timer("compact adjacency");
+      vector<int> packedOffsets(numberOfNodes + 1, 0), packedNeighbors, packedWeights;
+      packedNeighbors.reserve(neighbors.size() + 2 * pendingRows.size());
+      packedWeights.reserve(neighbors.size() + 2 * pendingRows.size());
+      for (int u = 0; u < numberOfNodes; u++)
+      {
+        Row edges = row(u);
+        packedNeighbors.insert(packedNeighbors.end(), edges.neighbors, edges.neighbors + edges.size);
+        packedWeights.insert(packedWeights.end(), edges.weights, edges.weights + edges.size);
+        packedOffsets[u + 1] = packedNeighbors.size();
+      }
+      offsets.swap(packedOffsets);
+      neighbors.swap(packedNeighbors);
+      weights.swap(packedWeights);
+      pendingRows.clear();
+      pendingRow.assign(numberOfNodes, -1);
+    }
+    adjacencyEdited = false;
+    refreshChecksum();
+  }
+
+  // Appends a country without borders and returns its id
+  int addCountry(string_view code, string_view name, double latitude, double longitude, int population, int area)
+  {
+    beginUpdates();
+    int id = nodes.add(code, name, latitude, longitude, population, area);
+    numberOfNodes++;
+    if (nodes.ids[id] >= (int)nodeOfId.size())
+      nodeOfId.resize(nodes.ids[id] + 1, -1);
+    nodeOfId[nodes.ids[id]] = id;
+    nameIndex.insert(nodes, id);
+    codeIndex.insert(nodes, id);
+    offsets.push_back(offsets.back());
+    pointX.push_back(0);
+    pointY.push_back(0);
+    pointZ.push_back(0);
+    surfacePoint(latitude, longitude, pointX[id], pointY[id], pointZ[id]);
+    if (allPairs.numberOfNodes == numberOfNodes - 1)
+      allPairs.addNode();
+    for (auto &fromLandmark : landmarkDistance)
+    {
+      fromLandmark.push_back(INT_MAX);
+    }
+    hierarchyStale = hierarchy.built();
+    if (!forestStale)
+      forest.buildAdjacency(numberOfNodes, nodes.liveCount());
+    nameSearch = NameSearch();
+    spatialIndex = SpatialIndex();
+    adjacencyEdited = true;
+    topologyRevision++;
+    dataRevision++;
+    endUpdates();
+    return id;
+  }
+
+  // True for the id of a country that has not been removed
+  bool liveCountry(int id)
+  {
+    return id >= 0 && id < numberOfNodes && nodes.live(id);
+  }
+
+  // Removes a country and its borders. Its id stays allocated, unused.
+  // False if there is no such country.
+  bool removeCountry(int id)
+  {
+    if (!liveCountry(id))
+      return false;
+    beginUpdates();
+    Row edges = row(id);
+    vector<int> bordering(edges.neighbors, edges.neighbors + edges.size);
+    for (int other : bordering)
+    {
+      if (other == id)
+        setEntry(id, id, INT_MAX);
+      else
+        removeBorder(id, other);
+    }
+    nameIndex.erase(nodes, id);
+    codeIndex.erase(nodes, id);
+    nodes.present[id / 64] &= ~(1ULL << (id % 64));
+    // Its borders are gone, so the forest counted it as a component of its own
+    if (!forestStale)
+      forest.components--;
+    nameSearch = NameSearch();
+    spatialIndex = SpatialIndex();
+    topologyRevision++;
+    dataRevision++;
+    endUpdates();
+    return true;
+  }
+
+  // Adds the border between two countries, costed by great circle distance
+  // like the borders read from the dataset
+  bool addBorder(int a, int b)
+  {
+    if (a == b || !liveCountry(a) || !liveCountry(b))
+      return false;
+    double latitudeA = toRadians(nodes.latitudes[a]), latitudeB = toRadians(nodes.latitudes[b]);
+    int weight = (int)haversineKernel(latitudeA, cos(latitudeA), latitudeB, cos(latitudeB), toRadians(nodes.longitudes[b]) - toRadians(nodes.longitudes[a]));
+    nodes.insertBorder(a, nodes.name(b));
+    nodes.insertBorder(b, nodes.name(a));
+    return setBorderWeight(a, b, weight);
+  }
+
+  bool removeBorder(int a, int b)
+  {
+    if (a == b || !liveCountry(a) || !liveCountry(b))
+      return false;
+    nodes.eraseBorder(a, nodes.name(b));
+    nodes.eraseBorder(b, nodes.name(a));
+    return setBorderWeight(a, b, INT_MAX);
+  }
+
+  // Sets the cost of the border between a and b, adding it if missing;
+  // INT_MAX removes it. False if nothing changed or the countries or weight
+  // are not valid: the path repairs need weights of at least 0.
+  bool setBorderWeight(int a, int b, int weight)
+  {
+    if (a == b || weight < 0 || !liveCountry(a) || !liveCountry(b))
+      return false;
+    int old = edgeWeight(a, b);
+    if (old == weight)
+      return false;
+    beginUpdates();
+    setEntry(a, b, weight);
+    setEntry(b, a, weight);
+    if (weight < old)
+      borderCheapened(a, b, weight);
+    else
+      borderDearer(a, b);
+    topologyRevision++;
+    endUpdates();
+    return true;
+  }
+
+  // False if there is no such country
+  bool setPopulation(int id, int population)
+  {
+    if (!liveCountry(id))
+      return false;
+    nodes.populations[id] = population;
+    dataRevision++;
+    return true;
+  }
+
+  bool setArea(int id, int area)
+  {
+    if (!liveCountry(id))
+      return false;
+    nodes.areas[id] = area;
+    dataRevision++;
+    return true;
+  }
+
+  // Inserts, updates or (weight INT_MAX) erases the entry for v in row u.
+  // A new weight is written in place; a row that gains or loses an entry is
+  // copied aside on its first edit and changed there, O(degree), until the
+  // next compact.
+  void setEntry(int u, int v, int weight)
+  {
+    adjacencyEdited = true;
+    Row edges = row(u);
+    const int *it = lower_bound(edges.neighbors, edges.neighbors + edges.size, v);
+    int e = it - edges.neighbors;
+    bool found = e < edges.size && *it == v;
+    if (found && weight != INT_MAX)
+    {
+      const_cast<int *>(edges.weights)[e] = weight;
+      return;
+    }
+    if (!found && weight == INT_MAX)
+      return;
+    if ((int)pendingRow.size() < numberOfNodes)
+      pendingRow.resize(numberOfNodes, -1);
+    if (pendingRow[u] == -1)
+    {
+      pendingRow[u] = pendingRows.size();
+      pendingRows.push_back({vector<int>(edges.neighbors, edges.neighbors + edges.size), vector<int>(edges.weights, edges.weights + edges.size)});
+    }
+    PendingRow &pending = pendingRows[pendingRow[u]];
+    if (found)
+    {
+      pending.neighbors.erase(pending.neighbors.begin() + e);
+      pending.weights.erase(pending.weights.begin() + e);
+    }
+    else
+    {
+      pending.neighbors.insert(pending.neighbors.begin() + e, v);
+      pending.weights.insert(pending.weights.begin() + e, weight);
+    }
+  }
+
+  void borderCheapened(int a, int b, int weight)
+  {
+    double dx = pointX[a] - pointX[b], dy = pointY[a] - pointY[b], dz = pointZ[a] - pointZ[b];
+    double chord = sqrt(dx * dx + dy * dy + dz * dz);
+    if (chord > 0)
+      heuristicScale = min(heuristicScale, weight / chord);
+
+    int n = numberOfNodes;
+    if (allPairs.numberOfNodes == n)
+    {
+#pragma omp parallel for schedule(dynamic, 64)
+      for (int source = 0; source < n; source++)
+      {
+        repairDistances(allPairs.row(source), allPairs.parents(source), a, b, weight);
+      }
+    }
+    for (auto &fromLandmark : landmarkDistance)
+    {
+      repairDistances(fromLandmark.data(), nullptr, a, b, weight);
+    }
+    hierarchyStale = hierarchy.built();
+
+    // Cycle property: the new edge replaces the heaviest edge on the forest
+    // path between its ends if it is lighter, or joins two trees
+    if (forestStale)
+      return;
+    vector<int> parent(n, -1), parentWeight(n, 0), queue = {a};
+    parent[a] = a;
+    for (size_t head = 0; head < queue.size() && parent[b] == -1; head++)
+    {
+      int u = queue[head];
+      for (int e = forest.offsets[u]; e < forest.offsets[u + 1]; e++)
+      {
+        if (parent[forest.neighbors[e]] == -1)
+        {
+          parent[forest.neighbors[e]] = u;
+          parentWeight[forest.neighbors[e]] = forest.weights[e];
+          queue.push_back(forest.neighbors[e]);
+        }
+      }
+    }
+    tuple<int, int, int> edge = make_tuple(min(a, b), max(a, b), weight);
+    if (parent[b] == -1)
+    {
+      forest.edges.push_back(edge);
+    }
+    else
+    {
+      int heaviest = b;
+      for (int v = b; v != a; v = parent[v])
+      {
+        if (parentWeight[v] > parentWeight[heaviest])
+          heaviest = v;
+      }
+      if (parentWeight[heaviest] <= weight)
+        return;
+      int u = parent[heaviest], v = heaviest;
+      for (auto &treeEdge : forest.edges)
+      {
+        if (get<0>(treeEdge) == min(u, v) && get<1>(treeEdge) == max(u, v))
+          treeEdge = edge;
+      }
+    }
+    forest.buildAdjacency(n, nodes.liveCount());
+  }
+
+  void borderDearer(int a, int b)
+  {
+    // Only sources whose shortest path tree used the edge can change
+    int n = numberOfNodes;
+    if (allPairs.numberOfNodes == n)
+    {
+#pragma omp parallel
+      {
+        vector<uint8_t> below(n, 0);
+        vector<int> subtree;
+#pragma omp for schedule(dynamic, 64)
+        for (int source = 0; source < n; source++)
+        {
+          int *distance = allPairs.row(source);
+          int *parent = allPairs.parents(source);
+          if (parent[b] == a)
+            repairSubtree(distance, parent, b, below, subtree);
+          else if (parent[a] == b)
+            repairSubtree(distance, parent, a, below, subtree);
+        }
+      }
+    }
+    landmarksStale = !landmarkDistance.empty();
+    hierarchyStale = hierarchy.built();
+    if (!forestStale)
+    {
+      for (auto &treeEdge : forest.edges)
+      {
+        forestStale |= get<0>(treeEdge) == min(a, b) && get<1>(treeEdge) == max(a, b);
+      }
+    }
+  }
+
+  // Lowers single source distances (and parents when given) after the edge
+  // a - b became cheaper: only nodes whose distance drops are visited, in
+  // Dijkstra order from the end of the edge that improved. Returns how many.
+  int repairDistances(int *distance, int *parent, int a, int b, int weight)
+  {
+    priority_queue<pair<int, int>, vector<pair<int, int>>, greater<pair<int, int>>> heap;
+    for (auto edge : {make_pair(a, b), make_pair(b, a)})
+    {
+      int from = edge.first, to = edge.second;
+      if (distance[from] != INT_MAX && distance[from] + weight < distance[to])
+      {
+        distance[to] = distance[from] + weight;
+        if (parent)
+          parent[to] = from;
+        heap.push({distance[to], to});
+      }
+    }
+    int improved = 0;
+    while (!heap.empty())
+    {
+      int dist = heap.top().first, vertex = heap.top().second;
+      heap.pop();
+      if (dist > distance[vertex])
+        continue;
+      improved++;
+      Row edges = row(vertex);
+      for (int e = 0; e < edges.size; e++)
+      {
+        int j = edges.neighbors[e];
+        if (dist + edges.weights[e] < distance[j])
+        {
+          distance[j] = dist + edges.weights[e];
+          if (parent)
+            parent[j] = vertex;
+          heap.push({distance[j], j});
+        }
+      }
+    }
+    return improved;
+  }
+
+  // Raises single source distances after the tree edge into root got dearer
+  // or went away. Only the subtree below root can lose, so it alone is
+  // searched again, seeded from its best neighbours outside the subtree. The
+  // subtree is collected from root down the tree itself (y is a child of x
+  // when it borders x and parent[y] == x), so the cost follows its size, not
+  // the graph's. below holds a zero flag per node and is left that way.
+  // Returns the size of the subtree.
+  int repairSubtree(int *distance, int *parent, int root, vector<uint8_t> &below, vector<int> &subtree)
+  {
+    subtree.assign(1, root);
+    below[root] = 1;
+    for (size_t i = 0; i < subtree.size(); i++)
+    {
+      int x = subtree[i];
+      Row edges = row(x);
+      for (int e = 0; e < edges.size; e++)
+      {
+        int y = edges.neighbors[e];
+        if (!below[y] && parent[y] == x)
+        {
+          below[y] = 1;
+          subtree.push_back(y);
+        }
+      }
+    }
+
+    priority_queue<pair<int, int>, vector<pair<int, int>>, greater<pair<int, int>>> heap;
+    for (int v : subtree)
+    {
+      distance[v] = INT_MAX;
+      parent[v] = -1;
+      Row edges = row(v);
+      for (int e = 0; e < edges.size; e++)
+      {
+        int y = edges.neighbors[e];
+        if (!below[y] && distance[y] != INT_MAX && distance[y] + edges.weights[e] < distance[v])
+        {
+          distance[v] = distance[y] + edges.weights[e];
+          parent[v] = y;
+        }
+      }
+      if (distance[v] != INT_MAX)
+        heap.push({distance[v], v});
+    }
+    while (!heap.empty())
+    {
+      int dist = heap.top().first, vertex = heap.top().second;
+      heap.pop();
+      if (dist > distance[vertex])
+        continue;
+      Row edges = row(vertex);
+      for (int e = 0; e < edges.size; e++)
+      {
+        int j = edges.neighbors[e];
+        if (below[j] && dist + edges.weights[e] < distance[j])
+        {
+          distance[j] = dist + edges.weights[e];
+          parent[j] = vertex;
+          heap.push({distance[j], j});
+        }
+      }
+    }
+    for (int v : subtree)
+    {
+      below[v] = 0;
+    }
+    return subtree.size();
+  }
+
+  // Keeps a repaired all pairs table recognisable as belonging to this graph
+  void refreshChecksum()
+  {
+    if (allPairs.numberOfNodes == numberOfNodes)
+      allPairs.checksum = adjacencyChecksum();
+  }
+
+  void buildSpatialIndex()
+  {
+    ScopedTimer timer("build spatial index");
+    spatialIndex.build(pointX, pointY, pointZ, &nodes.present);
+  }
+
+  // The k countries closest to (latitude, longitude) as (id, great circle km),
+  // closest first; builds the spatial index on first use
+  vector<pair<int, double>> nearestCountries(double latitude, double longitude, int k)
+  {
+    if (!spatialIndex.built())
+      buildSpatialIndex();
+    double x, y, z;
+    surfacePoint(latitude, longitude, x, y, z);
+    vector<pair<double, int>> found;
+    spatialIndex.nearest(x, y, z, k, found);
+    return withArcDistances(found);
+  }
+
+  // Every country within radiusKm great circle km of (latitude, longitude) as
+  // (id, km), closest first
+  vector<pair<int, double>> countriesWithin(double latitude, double longitude, double radiusKm)
+  {
+    if (!spatialIndex.built())
+      buildSpatialIndex();
+    double x, y, z;
+    surfacePoint(latitude, longitude, x, y, z);
+    // Chord of that arc, widened a little so rounding never drops a boundary point
+    double chord = 2 * EarthRadiusKm * sin(min(radiusKm / (2 * EarthRadiusKm), M_PI / 2)) + 1e-9;
+    vector<pair<double, int>> found;
+    spatialIndex.within(x, y, z, chord, found);
+    return withArcDistances(found);
+  }
+
+  vector<pair<int, double>> withArcDistances(vector<pair<double, int>> &found)
+  {
+    vector<pair<int, double>> result;
+    result.reserve(found.size());
+    for (auto &entry : found)
+    {
+      result.push_back({entry.second, chordToArc(sqrt(entry.first))});
+    }
+    return result;
+  }
+
+  void buildHierarchy()
+  {
+    ScopedTimer timer("build contraction hierarchy");
+    hierarchy.build(numberOfNodes, offsets, neighbors, weights);
+    hierarchyStale = false;
+  }
+
+  // Fills allPairs with one Dijkstra per source, spread over all cores
+  void allPairsDijkstra()
+  {
+    ScopedTimer timer("all pairs dijkstra");
+    int n = numberOfNodes;
+    allPairs.reset(n);
+#pragma omp parallel
+    {
+      vector<int> distance, parent, targets;
+#pragma omp for schedule(dynamic, 16)
+      for (int source = 0; source < n; source++)
+      {
+        dijkstraSearch(source, targets, distance, parent);
+        copy(distance.begin(), distance.end(), allPairs.row(source));
+        copy(parent.begin(), parent.end(), allPairs.parents(source));
+      }
+    }
+    allPairs.checksum = adjacencyChecksum();
+  }
+
+  // Relaxes the tile (rows of rowBlock, columns of columnBlock) through the
+  // intermediate nodes of kBlock
+  void floydWarshallTile(int kBlock, int rowBlock, int columnBlock, int blockSize)
+  {
+    int n = numberOfNodes;
+    int *distance = allPairs.distance.data();
+    int *predecessor = allPairs.predecessor.data();
+    int kEnd = min(kBlock + blockSize, n), rowEnd = min(rowBlock + blockSize, n), columnEnd = min(columnBlock + blockSize, n);
+    for (int k = kBlock; k < kEnd; k++)
+    {
+      for (int i = rowBlock; i < rowEnd; i++)
+      {
+        int viaK = distance[(size_t)i * n + k];
+        if (viaK == INT_MAX)
+          continue;
+        int *row = distance + (size_t)i * n;
+        int *kRow = distance + (size_t)k * n;
+        for (int j = columnBlock; j < columnEnd; j++)
+        {
+          if (kRow[j] != INT_MAX && viaK + kRow[j] < row[j])
+          {
+            row[j] = viaK + kRow[j];
+            predecessor[(size_t)i * n + j] = predecessor[(size_t)k * n + j];
+          }
+        }
+      }
+    }
+  }
+
+  // Single threaded all pairs using a cache blocked Floyd-Warshall: for each
+  // diagonal tile, first the tile itself, then its row and column, then the rest
+  void allPairsFloydWarshall(int blockSize = 64)
+  {
+    ScopedTimer timer("all pairs floyd warshall");
+    int n = numberOfNodes;
+    allPairs.reset(n);
+    for (int i = 0; i < n; i++)
+    {
+      allPairs.distance[(size_t)i * n + i] = 0;
+      for (int e = offsets[i]; e < offsets[i + 1]; e++)
+      {
+        if (neighbors[e] == i)
+          continue;
+        allPairs.distance[(size_t)i * n + neighbors[e]] = weights[e];
+        allPairs.predecessor[(size_t)i * n + neighbors[e]] = i;
+      }
+    }
+    for (int k = 0; k < n; k += blockSize)
+    {
+      floydWarshallTile(k, k, k, blockSize);
+      for (int j = 0; j < n; j += blockSize)
+      {
+        if (j == k)
+          continue;
+        floydWarshallTile(k, k, j, blockSize);
+        floydWarshallTile(k, j, k, blockSize);
+      }
+      for (int i = 0; i < n; i += blockSize)
+      {
+        for (int j = 0; j < n; j += blockSize)
+        {
+          if (i != k && j != k)
+            floydWarshallTile(k, i, j, blockSize);
+        }
+      }
+    }
+    allPairs.checksum = adjacencyChecksum();
+  }
+
+  void dijkstra(int source, int destination)
+  {
+    PathResult result = shortestPath(source, destination);
+    printDijkstra(result);
+  }
+  // Prim's tree of source's part of the map (see primKernel), returns the number of tree nodes
+  int primTree(int source, PrimBuffers &out)
+  {
+    ScopedTimer timer("prim", LatencyPrim);
+    return primKernel(view(), source, out);
+  }
+
+  void prims(int source)
+  {
+    PrimBuffers &tree = threadScratch().tree;
+    primTree(source, tree);
+    printPrims(tree, source);
+  }
+};
+
+// Read only view of a whole file, memory mapped where the platform allows it
+class MappedFile
+{
+public:
+  MappedFile(string fileName)
+  {
+#ifndef _WIN32
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+      void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped != MAP_FAILED)
+      {
+        madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+        begin = (const char *)mapped;
+        length = info.st_size;
+      }
+    }
+    close(fd);
+#else
+    ifstream file(fileName, ios::binary);
+    buffer.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    begin = buffer.data();
+    length = buffer.size();
+#endif
+  }
+  ~MappedFile()
+  {
+#ifndef _WIN32
+    if (begin != nullptr)
+      munmap((void *)begin, length);
+#endif
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  string_view data()
+  {
+    return string_view(begin, length);
+  }
+
+private:
+  const char *begin = nullptr;
+  size_t length = 0;
+#ifdef _WIN32
+  string buffer;
+#endif
+};
+
+// Splits the next CSV field off the front of rest. Quoted fields are returned
+// without their outer quotes (escaped "" pairs are left in place).
+string_view nextField(string_view &rest)
+{
+  string_view field;
+  if (!rest.empty() && rest[0] == '"')
+  {
+    size_t i = 1;
+    while (i < rest.size())
+    {
+      if (rest[i] == '"')
+      {
+        if (i + 1 < rest.size() && rest[i + 1] == '"')
+        {
+          i += 2;
+          continue;
+        }
+        break;
+      }
+      i++;
+    }
+    field = rest.substr(1, i - 1);
+    rest.remove_prefix(min(i + 1, rest.size()));
+  }
+  else
+  {
+    field = rest.substr(0, rest.find(','));
+    rest.remove_prefix(field.size());
+  }
+  if (!rest.empty() && rest[0] == ',')
+    rest.remove_prefix(1);
+  return field;
+}
+
+template <typename T>
+bool parseNumber(string_view field, T &value)
+{
+  auto result = from_chars(field.data(), field.data() + field.size(), value);
+  return result.ec == errc() && !field.empty();
+}
+
+// Parses one row: Code,Country,latitude,longitude,Population,"""Neighbour,...,""",Area
+// and appends it to nodes. Returns false if the coordinates could not be parsed (they are left at 0).
+bool parseCountry(string_view line, NodeTable &nodes)
+{
+  string_view rest = line;
+  string_view code = nextField(rest);
+  string_view name = nextField(rest);
+  string_view latitudeField = nextField(rest);
+  string_view longitudeField = nextField(rest);
+  string_view populationField = nextField(rest);
+  string_view borders = nextField(rest);
+  string_view areaField = nextField(rest);
+
+  double latitude = 0, longitude = 0;
+  int population = 0, area = 0;
+  bool valid = parseNumber(latitudeField, latitude);
+  valid = parseNumber(longitudeField, longitude) && valid;
+  parseNumber(populationField, population);
+  parseNumber(areaField, area);
+  nodes.add(code, name, latitude, longitude, population, area);
+  while (!borders.empty())
+  {
+    size_t comma = borders.find(',');
+    string_view country = borders.substr(0, comma);
+    borders.remove_prefix(comma == borders.npos ? borders.size() : comma + 1);
+    while (!country.empty() && country.front() == '"')
+      country.remove_prefix(1);
+    while (!country.empty() && country.back() == '"')
+      country.remove_suffix(1);
+    if (!country.empty())
+      nodes.addBorder(country);
+  }
+  return valid;
+}
+
+// Parses every complete line in text, lineNumber is the file line text starts on
+void parseCountries(string_view text, int lineNumber, NodeTable &nodes)
+{
+  while (!text.empty())
+  {
+    size_t end = text.find('\n');
+    string_view line = text.substr(0, end);
+    text.remove_prefix(end == text.npos ? text.size() : end + 1);
+    if (!line.empty() && line.back() == '\r')
+      line.remove_suffix(1);
+    if (!line.empty() && !parseCountry(line, nodes))
+      cerr << "Invalid coordinates on line " << lineNumber << ": " << line << endl;
+    lineNumber++;
+  }
+  instrumentation.count(CounterRowsParsed, nodes.size());
+}
+
+// Loads a countries CSV (header row first). Large files are cut into chunks at
+// line boundaries and parsed in parallel, node ids follow row order.
+NodeTable loadCountries(string fileName)
+{
+  ScopedTimer timer("parse csv");
+  MappedFile file(fileName);
+  string_view text = file.data();
+  size_t header = text.find('\n');
+  text.remove_prefix(header == text.npos ? text.size() : header + 1);
+
+  const size_t chunkSize = 16 << 20;
+  vector<size_t> cuts = {0};
+  while (text.size() - cuts.back() > chunkSize)
+  {
+    size_t cut = text.find('\n', cuts.back() + chunkSize);
+    if (cut == text.npos)
+      break;
+    cuts.push_back(cut + 1);
+  }
+  cuts.push_back(text.size());
+
+  int chunks = cuts.size() - 1;
+  vector<NodeTable> parts(chunks);
+  vector<int> firstLine(chunks, 2);
+  for (int c = 1; c < chunks; c++)
+  {
+    // Line numbers are only needed for error messages, counting them is cheap next to parsing
+    firstLine[c] = firstLine[c - 1] + count(text.begin() + cuts[c - 1], text.begin() + cuts[c], '\n');
+  }
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int c = 0; c < chunks; c++)
+  {
+    parseCountries(text.substr(cuts[c], cuts[c + 1] - cuts[c]), firstLine[c], parts[c]);
+  }
+
+  if (chunks == 1)
+    return move(parts[0]);
+  NodeTable nodes;
+  for (auto &part : parts)
+  {
+    nodes.append(part);
+  }
+  return nodes;
+}
+
+// One edge per border listed in the dataset, weighted by the distance between the
+// two countries in km. Borders naming an unknown country are skipped.
+vector<tuple<int, int, int>> borderEdges(NodeTable &nodes)
+{
+  ScopedTimer timer("border edges");
+  vector<int> from, to;
+  {
+    ScopedTimer resolve("resolve border names");
+    CountryIndex nameIndex;
+    nameIndex.build(nodes, false);
+    from.reserve(nodes.borderNames.size());
+    to.reserve(nodes.borderNames.size());
+    for (int id = 0; id < nodes.size(); id++)
+    {
+      for (int b = nodes.borderOffsets[id]; b < nodes.borderOffsets[id + 1]; b++)
+      {
+        int toId = nameIndex.find(nodes, nodes.strings.view(nodes.borderNames[b]));
+        if (toId != -1)
+        {
+          from.push_back(id);
+          to.push_back(toId);
+        }
+      }
+    }
+    instrumentation.count(CounterBordersResolved, from.size());
+  }
+  ScopedTimer weigh("haversine weights");
+  GeoColumns points;
+  points.assign(nodes.latitudes, nodes.longitudes);
+  vector<double> distances(from.size());
+  haversinePairs(points, from.data(), to.data(), from.size(), distances.data());
+  vector<tuple<int, int, int>> weightedEdges;
+  weightedEdges.reserve(from.size());
+  for (size_t e = 0; e < from.size(); e++)
+  {
+    weightedEdges.push_back(make_tuple(from[e], to[e], (int)distances[e]));
+  }
+  return weightedEdges;
+}
+
+// Position of (x, y) along a Hilbert curve filling the 2^16 by 2^16 grid
+uint64_t hilbertIndex(uint32_t x, uint32_t y)
+{
+  uint64_t index = 0;
+  for (uint32_t s = 1u << 15; s > 0; s /= 2)
+  {
+    uint32_t rx = (x & s) > 0;
+    uint32_t ry = (y & s) > 0;
+    index += (uint64_t)s * s * ((3 * rx) ^ ry);
+    // Rotate the quadrant so the curve stays continuous
+    if (ry == 0)
+    {
+      if (rx == 1)
+      {
+        x = 0xffff - x;
+        y = 0xffff - y;
+      }
+      swap(x, y);
+    }
+  }
+  return index;
+}
+
+// Countries sorted along a Hilbert curve over longitude and latitude, so
+// countries near each other on the map get nearby ids. order[i] is the
+// current id of the country to place at i.
+vector<int> hilbertOrder(NodeTable &nodes)
+{
+  ScopedTimer timer("hilbert order");
+  int n = nodes.size();
+  vector<pair<uint64_t, int>> keyed(n);
+  for (int i = 0; i < n; i++)
+  {
+    uint32_t x = (uint32_t)(clamp((nodes.longitudes[i] + 180) / 360, 0.0, 1.0) * 0xffff);
+    uint32_t y = (uint32_t)(clamp((nodes.latitudes[i] + 90) / 180, 0.0, 1.0) * 0xffff);
+    keyed[i] = make_pair(hilbertIndex(x, y), i);
+  }
+  sort(keyed.begin(), keyed.end());
+  vector<int> order(n);
+  for (int i = 0; i < n; i++)
+  {
+    order[i] = keyed[i].second;
+  }
+  return order;
+}
+
+// Reverse Cuthill-McKee order of the border graph: breadth first from the
+// lowest degree country of each component, neighbours taken by increasing
+// degree, then reversed. Keeps every edge's endpoints close in id.
+vector<int> cuthillMcKeeOrder(int n, vector<tuple<int, int, int>> &edges)
+{
+  ScopedTimer timer("cuthill-mckee order");
+  vector<int> offsets(n + 1, 0);
+  for (const auto &edge : edges)
+  {
+    offsets[get<0>(edge) + 1]++;
+    offsets[get<1>(edge) + 1]++;
+  }
+  for (int i = 0; i < n; i++)
+  {
+    offsets[i + 1] += offsets[i];
+  }
+  vector<int> adjacent(offsets[n]);
+  vector<int> next(offsets.begin(), offsets.end() - 1);
+  for (const auto &edge : edges)
+  {
+    adjacent[next[get<0>(edge)]++] = get<1>(edge);
+    adjacent[next[get<1>(edge)]++] = get<0>(edge);
+  }
+  auto degree = [&](int v) { return offsets[v + 1] - offsets[v]; };
+
+  vector<int> byDegree(n);
+  iota(byDegree.begin(), byDegree.end(), 0);
+  stable_sort(byDegree.begin(), byDegree.end(), [&](int a, int b) { return degree(a) < degree(b); });
+  vector<char> placed(n, 0);
+  vector<int> order;
+  order.reserve(n);
+  for (int start : byDegree)
+  {
+    if (placed[start])
+      continue;
+    placed[start] = 1;
+    size_t head = order.size();
+    order.push_back(start);
+    while (head < order.size())
+    {
+      int u = order[head++];
+      size_t first = order.size();
+      for (int e = offsets[u]; e < offsets[u + 1]; e++)
+      {
+        if (!placed[adjacent[e]])
+        {
+          placed[adjacent[e]] = 1;
+          order.push_back(adjacent[e]);
+        }
+      }
+      stable_sort(order.begin() + first, order.end(), [&](int a, int b) { return degree(a) < degree(b); });
+    }
+  }
+  reverse(order.begin(), order.end());
+  return order;
+}
+
+// Renumbers the countries so order[i] becomes id i, before the graph is built
+// over them. The table keeps each country's original id (NodeTable::ids, see
+// Graph::countryWithId) and edges are moved to the new ids.
+void renumberCountries(NodeTable &nodes, vector<tuple<int, int, int>> &edges, vector<int> &order)
+{
+  ScopedTimer timer("renumber countries");
+  vector<int> position(order.size());
+  for (size_t i = 0; i < order.size(); i++)
+  {
+    position[order[i]] = i;
+  }
+  nodes = nodes.permuted(order);
+  for (auto &edge : edges)
+  {
+    get<0>(edge) = position[get<0>(edge)];
+    get<1>(edge) = position[get<1>(edge)];
+  }
+}
+
+// Snapshot file: a header, a table of sections, then the raw bytes of each
+// column at a 64 byte aligned offset, so loading is one bulk copy per column
+// out of the mapped file. Every section carries a checksum of its bytes and
+// the header one of the table, so truncated or corrupted files are refused.
+// Values are in native byte order; byteOrder rejects files from a machine
+// with the other order.
+const char SnapshotMagic[8] = {'C', 'T', 'R', 'Y', 'S', 'N', 'A', 'P'};
+const uint32_t SnapshotVersion = 2;
+
+struct SnapshotHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t sectionCount;
+  uint32_t reserved;
+  uint64_t tableChecksum;
+};
+
+struct SnapshotSection
+{
+  uint32_t kind;
+  uint32_t elementSize;
+  uint64_t count;
+  uint64_t offset;
+  uint64_t checksum;
+};
+
+enum SnapshotKind
+{
+  SnapshotIds = 1,
+  SnapshotCodes,
+  SnapshotNames,
+  SnapshotLatitudes,
+  SnapshotLongitudes,
+  SnapshotPopulations,
+  SnapshotAreas,
+  SnapshotBorderOffsets,
+  SnapshotBorderNames,
+  SnapshotStrings,
+  SnapshotOffsets,
+  SnapshotNeighbors,
+  SnapshotWeights,
+  SnapshotPointX,
+  SnapshotPointY,
+  SnapshotPointZ,
+  SnapshotHeuristicScale,
+  SnapshotNameSlots,
+  SnapshotNameTags,
+  SnapshotCodeSlots,
+  SnapshotCodeTags,
+  SnapshotPresent
+};
+
+// FNV-1a over 8 byte words, then the trailing bytes
+uint64_t checksumBytes(const char *data, size_t length)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * 1099511628211ULL;
+  }
+  for (; i < length; i++)
+  {
+    hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+struct SnapshotColumn
+{
+  uint32_t kind;
+  uint32_t elementSize;
+  uint64_t count;
+  const char *data;
+};
+
+template <typename Column>
+SnapshotColumn snapshotColumn(uint32_t kind, Column &column)
+{
+  return {kind, (uint32_t)sizeof(column[0]), (uint64_t)column.size(), (const char *)column.data()};
+}
+
+bool saveSnapshot(string fileName, Graph &graph)
+{
+  ScopedTimer timer("save snapshot");
+  NodeTable &nodes = graph.nodes;
+  vector<double> scale = {graph.heuristicScale};
+  vector<SnapshotColumn> columns = {
+      snapshotColumn(SnapshotIds, nodes.ids),
+      snapshotColumn(SnapshotCodes, nodes.codes),
+      snapshotColumn(SnapshotNames, nodes.names),
+      snapshotColumn(SnapshotLatitudes, nodes.latitudes),
+      snapshotColumn(SnapshotLongitudes, nodes.longitudes),
+      snapshotColumn(SnapshotPopulations, nodes.populations),
+      snapshotColumn(SnapshotAreas, nodes.areas),
+      snapshotColumn(SnapshotBorderOffsets, nodes.borderOffsets),
+      snapshotColumn(SnapshotBorderNames, nodes.borderNames),
+      snapshotColumn(SnapshotStrings, nodes.strings.arena),
+      snapshotColumn(SnapshotOffsets, graph.offsets),
+      snapshotColumn(SnapshotNeighbors, graph.neighbors),
+      snapshotColumn(SnapshotWeights, graph.weights),
+      snapshotColumn(SnapshotPointX, graph.pointX),
+      snapshotColumn(SnapshotPointY, graph.pointY),
+      snapshotColumn(SnapshotPointZ, graph.pointZ),
+      snapshotColumn(SnapshotHeuristicScale, scale),
+      snapshotColumn(SnapshotNameSlots, graph.nameIndex.slotTable()),
+      snapshotColumn(SnapshotNameTags, graph.nameIndex.tagTable()),
+      snapshotColumn(SnapshotCodeSlots, graph.codeIndex.slotTable()),
+      snapshotColumn(SnapshotCodeTags, graph.codeIndex.tagTable()),
+      snapshotColumn(SnapshotPresent, nodes.present)};
+
+  auto aligned = [](uint64_t offset)
+  { return (offset + 63) / 64 * 64; };
+  vector<SnapshotSection> table;
+  uint64_t offset = aligned(sizeof(SnapshotHeader) + columns.size() * sizeof(SnapshotSection));
+  for (auto &column : columns)
+  {
+    uint64_t bytes = column.count * column.elementSize;
+    table.push_back({column.kind, column.elementSize, column.count, offset, checksumBytes(column.data, bytes)});
+    offset = aligned(offset + bytes);
+  }
+  SnapshotHeader header;
+  memcpy(header.magic, SnapshotMagic, 8);
+  header.version = SnapshotVersion;
+  header.byteOrder = 0x01020304;
+  header.sectionCount = table.size();
+  header.reserved = 0;
+  header.tableChecksum = checksumBytes((const char *)table.data(), table.size() * sizeof(SnapshotSection));
+
+  ofstream file(fileName, ios::binary);
+  if (!file)
+    return false;
+  file.write((const char *)&header, sizeof(header));
+  file.write((const char *)table.data(), table.size() * sizeof(SnapshotSection));
+  uint64_t written = sizeof(header) + table.size() * sizeof(SnapshotSection);
+  const char padding[64] = {};
+  for (size_t c = 0; c < columns.size(); c++)
+  {
+    file.write(padding, table[c].offset - written);
+    file.write(columns[c].data, columns[c].count * columns[c].elementSize);
+    written = table[c].offset + columns[c].count * columns[c].elementSize;
+  }
+  return (bool)file;
+}
+
+// Copies the section of the given kind into column (a vector or string),
+// false if it is missing, has the wrong element size, or fails its checksum
+template <typename Column>
+bool readSnapshotColumn(string_view data, vector<SnapshotSection> &table, uint32_t kind, Column &column)
+{
+  for (auto &section : table)
+  {
+    if (section.kind != kind)
+      continue;
+    uint64_t bytes = section.count * section.elementSize;
+    if (section.elementSize != sizeof(column[0]) || section.offset > data.size() || bytes > data.size() - section.offset)
+      return false;
+    const char *begin = data.data() + section.offset;
+    if (checksumBytes(begin, bytes) != section.checksum)
+      return false;
+    column.resize(section.count);
+    if (bytes > 0)
+      memcpy((char *)column.data(), begin, bytes);
+    return true;
+  }
+  return false;
+}
+
+// Fills nodes and arrays from a snapshot written by saveSnapshot, false if
+// the file is missing, from another version, or damaged
+bool loadSnapshot(string fileName, NodeTable &nodes, GraphArrays &arrays)
+{
+  ScopedTimer timer("load snapshot");
+  MappedFile file(fileName);
+  string_view data = file.data();
+  SnapshotHeader header;
+  if (data.size() < sizeof(header))
+    return false;
+  memcpy(&header, data.data(), sizeof(header));
+  if (memcmp(header.magic, SnapshotMagic, 8) != 0 || header.version != SnapshotVersion || header.byteOrder != 0x01020304)
+    return false;
+  uint64_t tableBytes = (uint64_t)header.sectionCount * sizeof(SnapshotSection);
+  if (tableBytes > data.size() - sizeof(header) || checksumBytes(data.data() + sizeof(header), tableBytes) != header.tableChecksum)
+    return false;
+  vector<SnapshotSection> table(header.sectionCount);
+  memcpy(table.data(), data.data() + sizeof(header), tableBytes);
+
+  nodes = NodeTable();
+  vector<double> scale;
+  bool complete = readSnapshotColumn(data, table, SnapshotIds, nodes.ids) &&
+                  readSnapshotColumn(data, table, SnapshotCodes, nodes.codes) &&
+                  readSnapshotColumn(data, table, SnapshotNames, nodes.names) &&
+                  readSnapshotColumn(data, table, SnapshotLatitudes, nodes.latitudes) &&
+                  readSnapshotColumn(data, table, SnapshotLongitudes, nodes.longitudes) &&
+                  readSnapshotColumn(data, table, SnapshotPopulations, nodes.populations) &&
+                  readSnapshotColumn(data, table, SnapshotAreas, nodes.areas) &&
+                  readSnapshotColumn(data, table, SnapshotBorderOffsets, nodes.borderOffsets) &&
+                  readSnapshotColumn(data, table, SnapshotBorderNames, nodes.borderNames) &&
+                  readSnapshotColumn(data, table, SnapshotStrings, nodes.strings.arena) &&
+                  readSnapshotColumn(data, table, SnapshotOffsets, arrays.offsets) &&
+                  readSnapshotColumn(data, table, SnapshotNeighbors, arrays.neighbors) &&
+                  readSnapshotColumn(data, table, SnapshotWeights, arrays.weights) &&
+                  readSnapshotColumn(data, table, SnapshotPointX, arrays.pointX) &&
+                  readSnapshotColumn(data, table, SnapshotPointY, arrays.pointY) &&
+                  readSnapshotColumn(data, table, SnapshotPointZ, arrays.pointZ) &&
+                  readSnapshotColumn(data, table, SnapshotHeuristicScale, scale) &&
+                  readSnapshotColumn(data, table, SnapshotNameSlots, arrays.nameSlots) &&
+                  readSnapshotColumn(data, table, SnapshotNameTags, arrays.nameTags) &&
+                  readSnapshotColumn(data, table, SnapshotCodeSlots, arrays.codeSlots) &&
+                  readSnapshotColumn(data, table, SnapshotCodeTags, arrays.codeTags) &&
+                  readSnapshotColumn(data, table, SnapshotPresent, nodes.present);
+  size_t n = nodes.ids.size();
+  if (!complete || scale.size() != 1 || nodes.present.size() != (n + 63) / 64 || nodes.borderOffsets.size() != n + 1 || arrays.offsets.size() != n + 1 ||
+      arrays.pointX.size() != n || (size_t)arrays.offsets[n] != arrays.neighbors.size() ||
+      arrays.nameSlots.size() < 2 * n || (arrays.nameSlots.size() & (arrays.nameSlots.size() - 1)) != 0 ||
+      arrays.codeSlots.size() != arrays.nameSlots.size() || arrays.nameTags.size() != arrays.nameSlots.size() ||
+      arrays.codeTags.size() != arrays.codeSlots.size())
+  {
+    nodes = NodeTable();
+    return false;
+  }
+  arrays.heuristicScale = scale[0];
+  return true;
+}
+
+// Builds a synthetic map of n countries laid out on a jittered lat/lon grid,
+// every country bordering its east, south and south-east neighbours
+void syntheticGraph(int n, NodeTable &nodes, vector<tuple<int, int, int>> &weightedEdges)
+{
+  mt19937 rng(n);
+  uniform_real_distribution<double> jitter(-0.4, 0.4);
+  int side = (int)ceil(sqrt((double)n));
+  nodes = NodeTable();
+  weightedEdges.clear();
+  nodes.reserve(n);
+  weightedEdges.reserve(3 * (size_t)n);
+  for (int i = 0; i < n; i++)
+  {
+    double latitude = -80.0 + 160.0 * ((i / side) + 0.5 + jitter(rng)) / side;
+    double longitude = -180.0 + 360.0 * ((i % side) + 0.5 + jitter(rng)) / side;
+    nodes.add("S" + to_string(i), "Synthetic " + to_string(i), latitude, longitude, (int)(rng() % 100000000), (int)(rng() % 1000000));
+  }
+  vector<int> from, to;
+  for (int i = 0; i < n; i++)
+  {
+    int column = i % side;
+    int candidates[3] = {column + 1 < side ? i + 1 : -1, i + side, column + 1 < side ? i + side + 1 : -1};
+    for (int j : candidates)
+    {
+      if (j < 0 || j >= n)
+        continue;
+      from.push_back(i);
+      to.push_back(j);
+    }
+  }
+  GeoColumns points;
+  points.assign(nodes.latitudes, nodes.longitudes);
+  vector<double> distances(from.size());
+  haversinePairs(points, from.data(), to.data(), from.size(), distances.data());
+  for (size_t e = 0; e < from.size(); e++)
+  {
+    weightedEdges.push_back(make_tuple(from[e], to[e], (int)distances[e]));
+  }
+}
+
+double elapsedMs(chrono::steady_clock::time_point start)
+{
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Graph build time, adjacency memory and traversal times on synthetic maps
+void benchmarkGraph()
+{
+  int sizes[] = {10000, 100000, 1000000};
+  streambuf *console = cout.rdbuf();
+  for (int n : sizes)
+  {
+    NodeTable nodes;
+    vector<tuple<int, int, int>> weightedEdges;
+    syntheticGraph(n, nodes, weightedEdges);
+
+    auto start = chrono::steady_clock::now();
+    Graph graph(nodes, weightedEdges);
+    double buildMs = elapsedMs(start);
+
+    // Traversals print every country, send that to nowhere while timing
+    cout.rdbuf(nullptr);
+    start = chrono::steady_clock::now();
+    graph.bfsTraversal(0);
+    double bfsMs = elapsedMs(start);
+    start = chrono::steady_clock::now();
+    graph.dfsTraversal(0);
+    double dfsMs = elapsedMs(start);
+    cout.rdbuf(console);
+    cout.clear();
+
+    // Random point to point queries, then the same number batched over 10 popular sources
+    mt19937 rng(1);
+    int queryCount = 100;
+    vector<pair<int, int>> queries;
+    for (int q = 0; q < queryCount; q++)
+    {
+      queries.push_back(make_pair((int)(rng() % n), (int)(rng() % n)));
+    }
+    start = chrono::steady_clock::now();
+    for (auto &query : queries)
+    {
+      graph.shortestPath(query.first, query.second);
+    }
+    double queryUs = elapsedMs(start) * 1000.0 / queryCount;
+    for (auto &query : queries)
+    {
+      query.first = queries[rng() % 10].first;
+    }
+    start = chrono::steady_clock::now();
+    graph.shortestPaths(queries);
+    double batchUs = elapsedMs(start) * 1000.0 / queryCount;
+
+    double denseMb = (double)n * n * sizeof(int) / (1024.0 * 1024.0);
+    cout << "nodes: " << n << "  edges: " << weightedEdges.size() << endl;
+    cout << "  adjacency memory: " << graph.adjacencyBytes() / (1024.0 * 1024.0) << " MB (dense matrix would need " << denseMb << " MB)" << endl;
+    cout << "  build: " << buildMs << " ms  bfs: " << bfsMs << " ms  dfs: " << dfsMs << " ms" << endl;
+    cout << "  shortest path: " << queryUs << " us/query  batched: " << batchUs << " us/query" << endl;
+  }
+}
+
+// All pairs: blocked Floyd-Warshall against parallel Dijkstra at growing thread counts
+void benchmarkAllPairs()
+{
+  int sizes[] = {500, 1000, 2000};
+  int maxThreads = 1;
+#ifdef _OPENMP
+  maxThreads = omp_get_max_threads();
+#endif
+  vector<int> threadCounts;
+  for (int threads = 1; threads < maxThreads; threads *= 2)
+  {
+    threadCounts.push_back(threads);
+  }
+  threadCounts.push_back(maxThreads);
+  for (int n : sizes)
+  {
+    NodeTable nodes;
+    vector<tuple<int, int, int>> weightedEdges;
+    syntheticGraph(n, nodes, weightedEdges);
+    Graph graph(nodes, weightedEdges);
+
+    auto start = chrono::steady_clock::now();
+    graph.allPairsFloydWarshall();
+    double floydMs = elapsedMs(start);
+    vector<int> floydDistance = graph.allPairs.distance;
+    cout << "nodes: " << n << endl;
+    cout << "  blocked floyd-warshall (1 thread): " << floydMs << " ms" << endl;
+
+    double baseMs = 0;
+    for (int threads : threadCounts)
+    {
+#ifdef _OPENMP
+      omp_set_num_threads(threads);
+#endif
+      start = chrono::steady_clock::now();
+      graph.allPairsDijkstra();
+      double ms = elapsedMs(start);
+      if (threads == 1)
+        baseMs = ms;
+      cout << "  parallel dijkstra, " << threads << " threads: " << ms << " ms  speedup: " << baseMs / ms
+           << (graph.allPairs.distance == floydDistance ? "" : "  MISMATCH") << endl;
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(maxThreads);
+#endif
+  }
+}
+
+// Contraction hierarchy preprocessing cost and query latency against the heap Dijkstra
+void benchmarkHierarchy()
+{
+  int sizes[] = {1000, 10000, 20000};
+  for (int n : sizes)
+  {
+    NodeTable nodes;
+    vector<tuple<int, int, int>> weightedEdges;
+    syntheticGraph(n, nodes, weightedEdges);
+    Graph graph(nodes, weightedEdges);
+
+    mt19937 rng(1);
+    int queryCount = 1000;
+    vector<pair<int, int>> queries;
+    for (int q = 0; q < queryCount; q++)
+    {
+      queries.push_back(make_pair((int)(rng() % n), (int)(rng() % n)));
+    }
+    vector<int> expected;
+    auto start = chrono::steady_clock::now();
+    for (auto &query : queries)
+    {
+      expected.push_back(graph.shortestPath(query.first, query.second).distance);
+    }
+    double dijkstraUs = elapsedMs(start) * 1000.0 / queryCount;
+
+    start = chrono::steady_clock::now();
+    graph.buildHierarchy();
+    double buildMs = elapsedMs(start);
+
+    int mismatches = 0;
+    start = chrono::steady_clock::now();
+    for (int q = 0; q < queryCount; q++)
+    {
+      if (graph.shortestPath(queries[q].first, queries[q].second).distance != expected[q])
+        mismatches++;
+    }
+    double hierarchyUs = elapsedMs(start) * 1000.0 / queryCount;
+
+    cout << "nodes: " << n << endl;
+    cout << "  preprocessing: " << buildMs << " ms  shortcuts: " << graph.hierarchy.shortcuts << endl;
+    cout << "  dijkstra: " << dijkstraUs << " us/query  hierarchy: " << hierarchyUs << " us/query";
+    if (mismatches > 0)
+      cout << "  MISMATCHES: " << mismatches;
+    cout << endl;
+  }
+}
+
+// Settled nodes and latency of Dijkstra, A* and ALT on the same random point to point queries
+void benchmarkGoalDirected()
+{
+  int sizes[] = {10000, 100000};
+  for (int n : sizes)
+  {
+    NodeTable nodes;
+    vector<tuple<int, int, int>> weightedEdges;
+    syntheticGraph(n, nodes, weightedEdges);
+    Graph graph(nodes, weightedEdges);
+
+    auto start = chrono::steady_clock::now();
+    graph.buildLandmarks(16);
+    double landmarkMs = elapsedMs(start);
+
+    mt19937 rng(1);
+    int queryCount = 200;
+    long settled[3] = {0, 0, 0};
+    double totalMs[3] = {0, 0, 0};
+    int mismatches = 0;
+    vector<int> distance, parent;
+    PathBuffers buffers;
+    for (int q = 0; q < queryCount; q++)
+    {
+      int source = rng() % n, destination = rng() % n;
+      vector<int> targets = {destination};
+      start = chrono::steady_clock::now();
+      settled[0] += graph.dijkstraSearch(source, targets, distance, parent);
+      totalMs[0] += elapsedMs(start);
+      int expected = distance[destination];
+      for (int mode = 1; mode <= 2; mode++)
+      {
+        start = chrono::steady_clock::now();
+        settled[mode] += graph.goalDirectedSearch(source, destination, mode == 2, buffers);
+        totalMs[mode] += elapsedMs(start);
+        if (buffers.distanceTo(destination) != expected)
+          mismatches++;
+      }
+    }
+
+    const char *names[3] = {"dijkstra", "a*", "alt"};
+    cout << "nodes: " << n << "  (16 landmarks built in " << landmarkMs << " ms)" << endl;
+    for (int mode = 0; mode < 3; mode++)
+    {
+      cout << "  " << names[mode] << ": " << settled[mode] / queryCount << " settled/query  " << totalMs[mode] * 1000.0 / queryCount << " us/query" << endl;
+    }
+    if (mismatches > 0)
+      cout << "  MISMATCHES: " << mismatches << endl;
+  }
+}
+
+// CSV parse throughput on a large file made by repeating the rows of world_coordinates.csv
+void benchmarkLoader()
+{
+  MappedFile source("world_coordinates.csv");
+  string_view text = source.data();
+  size_t header = text.find('\n');
+  if (header == text.npos)
+  {
+    cout << "world_coordinates.csv not found" << endl;
+    return;
+  }
+  string_view rows = text.substr(header + 1);
+  string fileName = "countries_bench.csv";
+  {
+    ofstream file(fileName, ios::binary);
+    file << text.substr(0, header + 1);
+    for (size_t written = 0; written < (256u << 20); written += rows.size())
+    {
+      file << rows;
+    }
+  }
+  MappedFile bench(fileName);
+  double megabytes = bench.data().size() / (1024.0 * 1024.0);
+
+  int maxThreads = 1;
+#ifdef _OPENMP
+  maxThreads = omp_get_max_threads();
+#endif
+  for (int threads : {1, maxThreads})
+  {
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    auto start = chrono::steady_clock::now();
+    NodeTable nodes = loadCountries(fileName);
+    double ms = elapsedMs(start);
+    cout << threads << " thread(s): " << nodes.size() << " rows, " << megabytes << " MB in " << ms << " ms = " << megabytes / (ms / 1000.0) << " MB/s" << endl;
+    if (threads == 1)
+    {
+      start = chrono::steady_clock::now();
+      vector<tuple<int, int, int>> weightedEdges = borderEdges(nodes);
+      cout << "  border edges through the name index: " << weightedEdges.size() << " in " << elapsedMs(start) << " ms" << endl;
+    }
+    if (maxThreads == 1)
+      break;
+  }
+  remove(fileName.c_str());
+}
+
+// Filling the ranking queues and answering repeated top 20 requests
+void benchmarkRanking()
+{
+  int sizes[] = {100000, 1000000};
+  for (int n : sizes)
+  {
+    NodeTable nodes;
+    vector<tuple<int, int, int>> weightedEdges;
+    syntheticGraph(n, nodes, weightedEdges);
+    Graph graph(nodes, weightedEdges);
+
+    auto start = chrono::steady_clock::now();
+    RangeFilter everything;
+    vector<PriorityQueue> queues = graph.filterCountries(everything);
+    double fillMs = elapsedMs(start);
+
+    int repeats = 100;
+    vector<int> selected, cached;
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++)
+    {
+      selected = queues[0].topK(20);
+    }
+    double selectUs = elapsedMs(start) * 1000.0 / repeats;
+    start = chrono::steady_clock::now();
+    queues[0].ordered();
+    double sortMs = elapsedMs(start);
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++)
+    {
+      cached = queues[0].topK(20);
+    }
+    double cachedUs = elapsedMs(start) * 1000.0 / repeats;
+
+    cout << "rows: " << n << endl;
+    cout << "  fill population and area queues: " << fillMs << " ms" << endl;
+    cout << "  top 20 by bounded heap: " << selectUs << " us  full sort once: " << sortMs << " ms  top 20 from sorted: " << cachedUs << " us"
+         << (selected == cached ? "" : "  MISMATCH") << endl;
+  }
+}
+
+// Range selection over the packed columns against a row at a time branchy loop
+void benchmarkTraversal()
+{
+  int sizes[] = {1000000, 4000000};
+  for (int n : sizes)
+  {
+    for (int shortcuts = 0; shortcuts < 2; shortcuts++)
+    {
+      NodeTable nodes;
+      vector<tuple<int, int, int>> weightedEdges;
+      syntheticGraph(n, nodes, weightedEdges);
+      // Optionally add n / 2 random long links, which cuts the diameter from
+      // thousands of hops to a handful like a real transport network
+      mt19937 rng(n);
+      for (int i = 0; shortcuts && i < n / 2; i++)
+      {
+        weightedEdges.push_back(make_tuple(rng() % n, rng() % n, 1000));
+      }
+      Graph graph(nodes, weightedEdges);
+      int repeats = 5;
+
+      // The previous traversal: a fresh visited array per call and every
+      // discovery queued
+      auto start = chrono::steady_clock::now();
+      for (int r = 0; r < repeats; r++)
+      {
+        vector<bool> visited(n, false);
+        queue<int> q;
+        q.push(r);
+        while (!q.empty())
+        {
+          int vertex = q.front();
+          q.pop();
+          if (!visited[vertex])
+          {
+            visited[vertex] = true;
+            for (int e = graph.offsets[vertex]; e < graph.offsets[vertex + 1]; e++)
+            {
+              q.push(graph.neighbors[e]);
+            }
+          }
+        }
+      }
+      double oldMs = elapsedMs(start) / repeats;
+
+      TraversalBuffers traversal, optimized;
+      graph.breadthFirst(0, traversal);
+      start = chrono::steady_clock::now();
+      for (int r = 0; r < repeats; r++)
+      {
+        graph.breadthFirst(r, traversal);
+      }
+      double bfsMs = elapsedMs(start) / repeats;
+      start = chrono::steady_clock::now();
+      int mismatches = 0;
+      for (int r = 0; r < repeats; r++)
+      {
+        graph.directionOptimizingBfs(r, optimized);
+        graph.breadthFirst(r, traversal);
+        for (int v : traversal.order)
+        {
+          mismatches += !optimized.seen(v) || optimized.depth[v] != traversal.depth[v];
+        }
+      }
+      start = chrono::steady_clock::now();
+      for (int r = 0; r < repeats; r++)
+      {
+        graph.directionOptimizingBfs(r, optimized);
+      }
+      double optimizedMs = elapsedMs(start) / repeats;
+      start = chrono::steady_clock::now();
+      for (int r = 0; r < repeats; r++)
+      {
+        graph.depthFirst(r, traversal);
+      }
+      double dfsMs = elapsedMs(start) / repeats;
+      start = chrono::steady_clock::now();
+      int components = graph.connectedComponents(traversal);
+      double componentsMs = elapsedMs(start);
+      int levels = 0;
+      graph.breadthFirst(0, traversal);
+      for (int v : traversal.order)
+      {
+        levels = max(levels, traversal.depth[v] + 1);
+      }
+
+      cout << "nodes: " << n << (shortcuts ? " with random long links" : " grid") << "  BFS levels: " << levels << "  components: " << components << endl;
+      cout << "  BFS previous: " << oldMs << " ms  reused buffers: " << bfsMs << " ms  direction optimizing: " << optimizedMs << " ms" << (mismatches ? "  (depths differ)" : "") << endl;
+      cout << "  DFS: " << dfsMs << " ms  connected components: " << componentsMs << " ms" << endl;
+    }
+  }
+}
+
+void benchmarkSpanningForest()
+{
+  int sizes[] = {100000, 1000000, 4000000};
+  int maxThreads = 1;
+#ifdef _OPENMP
+  maxThreads = omp_get_max_threads();
+#endif
+  for (int n : sizes)
+  {
+    NodeTable nodes;
+    vector<tuple<int, int, int>> weightedEdges;
+    syntheticGraph(n, nodes, weightedEdges);
+    // Drop a quarter of the roads so the map falls apart into several pieces
+    mt19937 rng(n);
+    weightedEdges.erase(remove_if(weightedEdges.begin(), weightedEdges.end(), [&](const tuple<int, int, int> &)
+                                  { return rng() % 4 == 0; }),
+                        weightedEdges.end());
+    Graph graph(nodes, weightedEdges);
+
+    auto start = chrono::steady_clock::now();
+    SpanningForest kruskalForest = graph.kruskal();
+    double kruskalMs = elapsedMs(start);
+    cout << "nodes: " << n << "  edges: " << graph.neighbors.size() / 2 << "  trees: " << kruskalForest.components << "  weight: " << kruskalForest.totalWeight << endl;
+    cout << "  kruskal: " << kruskalMs << " ms" << endl;
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+#ifdef _OPENMP
+      omp_set_num_threads(threads);
+#endif
+      start = chrono::steady_clock::now();
+      SpanningForest boruvkaForest = graph.boruvka();
+      double boruvkaMs = elapsedMs(start);
+      bool same = boruvkaForest.totalWeight == kruskalForest.totalWeight && boruvkaForest.components == kruskalForest.components;
+      cout << "  boruvka, " << threads << " threads: " << boruvkaMs << " ms" << (same ? "" : "  (differs from kruskal)") << endl;
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(maxThreads);
+#endif
+  }
+}
+
+void benchmarkHaversine()
+{
+  int n = 1000000;
+  mt19937 rng(n);
+  uniform_real_distribution<double> unit(-1.0, 1.0);
+  vector<double> latitudes(n), longitudes(n);
+  for (int i = 0; i < n; i++)
+  {
+    latitudes[i] = asin(unit(rng)) * 180.0 / M_PI;
+    longitudes[i] = 180.0 * unit(rng);
+  }
+  GeoColumns points;
+  auto start = chrono::steady_clock::now();
+  points.assign(latitudes, longitudes);
+  double assignMs = elapsedMs(start);
+
+  vector<double> exact(n), batch(n);
+  double maxError = 0, maxRelative = 0;
+  auto compare = [&]()
+  {
+    for (int i = 0; i < n; i++)
+    {
+      double error = fabs(batch[i] - exact[i]);
+      maxError = max(maxError, error);
+      if (exact[i] > 1.0)
+        maxRelative = max(maxRelative, error / exact[i]);
+    }
+  };
+
+  int repeats = 10;
+  double exactMs = 0, batchMs = 0;
+  for (int r = 0; r < repeats; r++)
+  {
+    double latitude = latitudes[r], longitude = longitudes[r];
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+    {
+      exact[i] = haversineDistance(latitude, longitude, latitudes[i], longitudes[i]);
+    }
+    exactMs += elapsedMs(start);
+    start = chrono::steady_clock::now();
+    haversineOneToMany(latitude, longitude, points, batch.data());
+    batchMs += elapsedMs(start);
+    compare();
+  }
+  cout << "one to " << n << " points: exact " << exactMs * 1e6 / repeats / n << " ns/pair  batch " << batchMs * 1e6 / repeats / n << " ns/pair" << endl;
+
+  vector<int> from(n), to(n);
+  for (int i = 0; i < n; i++)
+  {
+    from[i] = rng() % n;
+    to[i] = rng() % n;
+  }
+  exactMs = batchMs = 0;
+  for (int r = 0; r < repeats; r++)
+  {
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+    {
+      exact[i] = haversineDistance(latitudes[from[i]], longitudes[from[i]], latitudes[to[i]], longitudes[to[i]]);
+    }
+    exactMs += elapsedMs(start);
+    start = chrono::steady_clock::now();
+    haversinePairs(points, from.data(), to.data(), n, batch.data());
+    batchMs += elapsedMs(start);
+  }
+  compare();
+  cout << n << " random pairs: exact " << exactMs * 1e6 / repeats / n << " ns/pair  batch " << batchMs * 1e6 / repeats / n << " ns/pair" << endl;
+  cout << "radian columns: " << assignMs << " ms  largest error: " << maxError << " km (" << maxRelative << " relative)" << endl;
+}
+
+void benchmarkSpatial()
+{
+  int sizes[] = {1000, 100000, 10000000};
+  for (int n : sizes)
+  {
+    // Uniform on the sphere: uniform sin(latitude) and longitude
+    mt19937 rng(n);
+    uniform_real_distribution<double> unit(-1.0, 1.0);
+    vector<double> latitudes(n), longitudes(n), x(n), y(n), z(n);
+    for (int i = 0; i < n; i++)
+    {
+      latitudes[i] = asin(unit(rng)) * 180.0 / M_PI;
+      longitudes[i] = 180.0 * unit(rng);
+      surfacePoint(latitudes[i], longitudes[i], x[i], y[i], z[i]);
+    }
+    SpatialIndex index;
+    auto start = chrono::steady_clock::now();
+    index.build(x, y, z);
+    double buildMs = elapsedMs(start);
+
+    int queries = n >= 10000000 ? 10 : 200;
+    int k = 10;
+    double radiusKm = 500;
+    double chord = 2 * EarthRadiusKm * sin(radiusKm / (2 * EarthRadiusKm));
+    double bruteNearestMs = 0, bruteWithinMs = 0, treeNearestMs = 0, treeWithinMs = 0;
+    long withinCount = 0;
+    int mismatches = 0;
+    vector<pair<double, int>> distances(n), found;
+    for (int q = 0; q < queries; q++)
+    {
+      double latitude = asin(unit(rng)) * 180.0 / M_PI, longitude = 180.0 * unit(rng);
+      double qx, qy, qz;
+      surfacePoint(latitude, longitude, qx, qy, qz);
+
+      start = chrono::steady_clock::now();
+      for (int i = 0; i < n; i++)
+      {
+        distances[i] = {haversineDistance(latitude, longitude, latitudes[i], longitudes[i]), i};
+      }
+      partial_sort(distances.begin(), distances.begin() + k, distances.end());
+      vector<int> bruteNearest;
+      for (int i = 0; i < k; i++)
+      {
+        bruteNearest.push_back(distances[i].second);
+      }
+      bruteNearestMs += elapsedMs(start);
+      start = chrono::steady_clock::now();
+      int bruteWithin = 0;
+      for (int i = 0; i < n; i++)
+      {
+        bruteWithin += haversineDistance(latitude, longitude, latitudes[i], longitudes[i]) <= radiusKm;
+      }
+      bruteWithinMs += elapsedMs(start);
+
+      start = chrono::steady_clock::now();
+      index.nearest(qx, qy, qz, k, found);
+      treeNearestMs += elapsedMs(start);
+      for (int i = 0; i < k; i++)
+      {
+        mismatches += found[i].second != bruteNearest[i];
+      }
+      start = chrono::steady_clock::now();
+      index.within(qx, qy, qz, chord, found);
+      treeWithinMs += elapsedMs(start);
+      withinCount += found.size();
+      mismatches += (int)found.size() != bruteWithin;
+    }
+    cout << "points: " << n << "  k-d tree build: " << buildMs << " ms" << endl;
+    cout << "  " << k << " nearest: brute force " << bruteNearestMs * 1000.0 / queries << " us  tree " << treeNearestMs * 1000.0 / queries << " us" << endl;
+    cout << "  within " << radiusKm << " km (" << withinCount / queries << " found on average): brute force " << bruteWithinMs * 1000.0 / queries << " us  tree " << treeWithinMs * 1000.0 / queries << " us" << endl;
+    cout << "  results differing from brute force: " << mismatches << endl;
+  }
+}
+
+// Pronounceable made up place name such as "Port Kaloveni"
+string syntheticName(mt19937 &rng)
+{
+  static const char *syllables[] = {"ka", "lo", "ve", "ni", "tar", "mon", "ri", "sa", "bel", "du", "an", "or", "gre", "vi", "sto", "la", "mar", "en", "zu", "pol",
+                                    "bra", "che", "di", "fen", "go", "hal", "is", "jo", "kir", "lun", "me", "nor", "ost", "pe", "qua", "ros", "tu", "ul", "wes", "yan"};
+  static const char *prefixes[] = {"Port ", "San ", "New ", "Upper ", "Lake "};
   string name;
-  double latitude;
-  double longitude;
-  int population;
-  int area;
-  vector<string> adjacentCountries;
+  if (rng() % 5 == 0)
+    name = prefixes[rng() % 5];
+  size_t wordStart = name.size();
+  int count = 2 + rng() % 3;
+  for (int i = 0; i < count; i++)
+  {
+    name += syllables[rng() % 40];
+  }
+  name[wordStart] = (char)toupper((unsigned char)name[wordStart]);
+  return name;
+}
+
+void benchmarkSearch()
+{
+  int sizes[] = {100000, 1000000};
+  for (int n : sizes)
+  {
+    mt19937 rng(n);
+    NodeTable nodes;
+    nodes.reserve(n);
+    for (int i = 0; i < n; i++)
+    {
+      nodes.add("S" + to_string(i), syntheticName(rng), 0, 0, 0, 0);
+    }
+    vector<tuple<int, int, int>> noEdges;
+    Graph graph(nodes, noEdges);
+    auto start = chrono::steady_clock::now();
+    graph.buildSearchIndex();
+    double buildMs = elapsedMs(start);
+
+    // Every keystroke of a few names, as an autocomplete box would send them
+    vector<string> keystrokes;
+    vector<string> typos;
+    for (int q = 0; q < 50; q++)
+    {
+      string name(nodes.name(rng() % n));
+      for (size_t length = 1; length <= name.size(); length++)
+      {
+        keystrokes.push_back(name.substr(0, length));
+      }
+      name[rng() % name.size()] = 'q';
+      typos.push_back(name);
+    }
+
+    long scanHits = 0, indexHits = 0, fuzzyHits = 0;
+    start = chrono::steady_clock::now();
+    for (string query : keystrokes)
+    {
+      transform(query.begin(), query.end(), query.begin(), [](unsigned char c)
+                { return tolower(c); });
+      for (int id = 0; id < n; id++)
+      {
+        string countryName(nodes.name(id));
+        transform(countryName.begin(), countryName.end(), countryName.begin(), [](unsigned char c)
+                  { return tolower(c); });
+        if (countryName.find(query) != countryName.npos)
+          scanHits++;
+      }
+    }
+    double scanUs = elapsedMs(start) * 1000.0 / keystrokes.size();
+    start = chrono::steady_clock::now();
+    for (string &query : keystrokes)
+    {
+      indexHits += graph.searchCountries(query).size();
+    }
+    double indexUs = elapsedMs(start) * 1000.0 / keystrokes.size();
+    start = chrono::steady_clock::now();
+    for (string &query : keystrokes)
+    {
+      graph.searchCountries(query, 10);
+    }
+    double topUs = elapsedMs(start) * 1000.0 / keystrokes.size();
+    start = chrono::steady_clock::now();
+    for (string &query : typos)
+    {
+      fuzzyHits += !graph.searchCountries(query, 10, 1).empty();
+    }
+    double fuzzyUs = elapsedMs(start) * 1000.0 / typos.size();
+
+    cout << "names: " << n << "  index build: " << buildMs << " ms" << endl;
+    cout << "  per keystroke: scan " << scanUs << " us  index " << indexUs << " us  index top 10 " << topUs << " us  (" << scanHits << " / " << indexHits << " hits)" << endl;
+    cout << "  one typo, top 10: " << fuzzyUs << " us  (" << fuzzyHits << " of " << typos.size() << " found)" << endl;
+  }
+}
+
+void benchmarkFilter()
+{
+  int sizes[] = {1000000, 4000000};
+  for (int n : sizes)
+  {
+    NodeTable nodes;
+    vector<tuple<int, int, int>> weightedEdges;
+    syntheticGraph(n, nodes, weightedEdges);
+    RangeFilter filter;
+    filter.minPopulation = 10000000;
+    filter.maxArea = 500000;
+    filter.minLatitude = -30;
+    filter.maxLatitude = 60;
+
+    int repeats = 20;
+    long scalarCount = 0, maskCount = 0;
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++)
+    {
+      for (int i = 0; i < n; i++)
+      {
+        if (nodes.populations[i] >= filter.minPopulation && nodes.areas[i] <= filter.maxArea && nodes.latitudes[i] >= filter.minLatitude && nodes.latitudes[i] <= filter.maxLatitude)
+          scalarCount++;
+      }
+    }
+    double scalarMs = elapsedMs(start) / repeats;
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++)
+    {
+      for (uint64_t word : nodes.select(filter))
+      {
+        maskCount += __builtin_popcountll(word);
+      }
+    }
+    double maskMs = elapsedMs(start) / repeats;
+
+    cout << "rows: " << n << "  selected: " << maskCount / repeats << (scalarCount == maskCount ? "" : "  MISMATCH") << endl;
+    cout << "  branchy loop: " << scalarMs << " ms  column kernels: " << maskMs << " ms";
+#ifdef __AVX2__
+    cout << " (AVX2)";
+#endif
+    cout << endl;
+  }
+}
+
+void benchmarkSnapshot()
+{
+  string fileName = "countries_bench.snapshot";
+  for (int n : {250000, 1000000})
+  {
+    NodeTable nodes;
+    vector<tuple<int, int, int>> weightedEdges;
+    syntheticGraph(n, nodes, weightedEdges);
+    auto start = chrono::steady_clock::now();
+    Graph graph(nodes, weightedEdges);
+    double buildMs = elapsedMs(start);
+    saveSnapshot(fileName, graph);
+
+    start = chrono::steady_clock::now();
+    NodeTable loadedNodes;
+    GraphArrays arrays;
+    bool loaded = loadSnapshot(fileName, loadedNodes, arrays);
+    Graph loadedGraph(loadedNodes, arrays);
+    double loadMs = elapsedMs(start);
+    MappedFile snapshot(fileName);
+    cout << n << " countries: graph from edges " << buildMs << " ms, from a " << snapshot.data().size() / (1024.0 * 1024.0) << " MB snapshot " << loadMs << " ms"
+         << (loaded && loadedGraph.adjacencyChecksum() == graph.adjacencyChecksum() ? "" : " (MISMATCH)") << endl;
+  }
+  remove(fileName.c_str());
+}
+
+// Applies a stream of border and country updates to a synthetic map with all
+// pairs, landmarks, hierarchy and spanning forest built, one at a time and
+// in batches sharing one compaction of the adjacency, then checks the
+// repaired results against a graph rebuilt from the updated borders and
+// reports how many updates cost as much as that rebuild
+void benchmarkUpdates()
+{
+  for (int n : {500, 2000})
+  {
+    NodeTable generated;
+    vector<tuple<int, int, int>> weightedEdges;
+    syntheticGraph(n, generated, weightedEdges);
+    double rebuildMs = 0;
+    cout << "nodes: " << n << endl;
+    for (int batch : {1, 20})
+    {
+      NodeTable nodes = generated;
+      Graph graph(nodes, weightedEdges);
+      auto start = chrono::steady_clock::now();
+      graph.allPairsDijkstra();
+      graph.buildLandmarks(8);
+      graph.buildHierarchy();
+      graph.spanningForest();
+      rebuildMs = elapsedMs(start);
+
+      mt19937 rng(n);
+      int updates = 200;
+      double cheaperMs = 0, dearerMs = 0, countryMs = 0;
+      int cheaper = 0, dearer = 0, countries = 0;
+      start = chrono::steady_clock::now();
+      for (int i = 0; i < updates; i++)
+      {
+        if (i % batch == 0)
+          graph.beginUpdates();
+        int a = rng() % graph.numberOfNodes;
+        Graph::Row edges = graph.row(a);
+        if (nodes.live(a) && edges.size > 0)
+        {
+          int b = edges.neighbors[rng() % edges.size];
+          auto step = chrono::steady_clock::now();
+          if (i % 10 == 9)
+          {
+            graph.removeCountry(a);
+            countryMs += elapsedMs(step);
+            countries++;
+          }
+          else if (i % 10 == 8)
+          {
+            int id = graph.addCountry("N" + to_string(i), "New " + to_string(i), nodes.latitudes[a] + 0.1, nodes.longitudes[a] + 0.1, 1000, 10);
+            graph.addBorder(id, a);
+            graph.addBorder(id, b);
+            countryMs += elapsedMs(step);
+            countries++;
+          }
+          else if (i % 2 == 0)
+          {
+            // A shortcut across two borders
+            Graph::Row beyond = graph.row(b);
+            graph.addBorder(a, beyond.neighbors[rng() % beyond.size]);
+            cheaperMs += elapsedMs(step);
+            cheaper++;
+          }
+          else
+          {
+            graph.removeBorder(a, b);
+            dearerMs += elapsedMs(step);
+            dearer++;
+          }
+          graph.setPopulation(a, rng() % 100000000);
+        }
+        if (i % batch == batch - 1 || i == updates - 1)
+          graph.endUpdates();
+      }
+      double updateMs = elapsedMs(start);
+
+      vector<int> from, to, cost;
+      graph.undirectedEdges(from, to, cost);
+      vector<tuple<int, int, int>> updatedEdges;
+      for (size_t e = 0; e < from.size(); e++)
+      {
+        updatedEdges.push_back(make_tuple(from[e], to[e], cost[e]));
+      }
+      Graph fresh(nodes, updatedEdges);
+      fresh.allPairsDijkstra();
+      bool sameAdjacency = fresh.adjacencyChecksum() == graph.adjacencyChecksum();
+      bool sameDistances = graph.allPairs.numberOfNodes == fresh.allPairs.numberOfNodes;
+      for (int s = 0; s < fresh.numberOfNodes && sameDistances; s++)
+      {
+        sameDistances = equal(fresh.allPairs.row(s), fresh.allPairs.row(s) + fresh.numberOfNodes, graph.allPairs.row(s));
+      }
+      // Removed countries are isolated nodes the forest must not count as trees
+      TraversalBuffers traversal;
+      int trees = fresh.connectedComponents(traversal) - (graph.numberOfNodes - nodes.liveCount());
+      SpanningForest &updatedForest = graph.spanningForest();
+      bool sameForest = fresh.kruskal().totalWeight == updatedForest.totalWeight && updatedForest.components == trees;
+      if (graph.hierarchyStale)
+        graph.buildHierarchy();
+      int wrongPaths = 0;
+      for (int q = 0; q < 1000; q++)
+      {
+        int s = rng() % graph.numberOfNodes, t = rng() % graph.numberOfNodes;
+        wrongPaths += graph.alt(s, t).distance != fresh.allPairs.at(s, t);
+        wrongPaths += graph.hierarchy.query(s, t).distance != fresh.allPairs.at(s, t);
+      }
+      if (batch == 1)
+        cout << "  full rebuild of all pairs, landmarks, hierarchy and forest: " << rebuildMs << " ms" << endl;
+      cout << "  " << updates << " updates " << (batch == 1 ? "one at a time" : "in batches of " + to_string(batch)) << ": " << updateMs
+           << " ms (new border " << cheaperMs / max(cheaper, 1) << " ms, removed border " << dearerMs / max(dearer, 1)
+           << " ms, added/removed country " << countryMs / max(countries, 1) << " ms each)" << endl;
+      cout << "    a rebuild wins after " << (int)ceil(rebuildMs / (updateMs / updates)) << " updates; adjacency "
+           << (sameAdjacency ? "matches" : "DIFFERS") << ", all pairs " << (sameDistances ? "match" : "DIFFER")
+           << ", forest weight and trees " << (sameForest ? "match" : "DIFFER") << ", wrong ALT/CH paths: " << wrongPaths << endl;
+    }
+  }
+}
+
+// Writes n made up countries to fileName in the world_coordinates.csv schema.
+// Positions are uniform over the sphere between 60S and 75N. Each country
+// borders those of its nearest dozen that pass the Gabriel test (no third
+// country inside the circle drawn on the line between them), which keeps the
+// map planar at about four borders each, and lists every border on both sides
+// as the dataset does. Population and area are log-normal around real world
+// medians, larger countries tending to hold more people.
+bool writeSyntheticCountries(string fileName, int n, unsigned seed)
+{
+  mt19937 rng(seed);
+  uniform_real_distribution<double> unit(0.0, 1.0);
+  normal_distribution<double> normal(0.0, 1.0);
+  double lowSin = sin(toRadians(-60.0)), highSin = sin(toRadians(75.0));
+  vector<double> latitudes(n), longitudes(n), x(n), y(n), z(n);
+  vector<string> names(n), codes(n);
+  vector<long long> populations(n), areas(n);
+  unordered_set<string> taken;
+  int codeLength = 2;
+  while (pow(26.0, codeLength) < n)
+    codeLength++;
+  for (int i = 0; i < n; i++)
+  {
+    latitudes[i] = asin(lowSin + (highSin - lowSin) * unit(rng)) * 180.0 / M_PI;
+    longitudes[i] = -180.0 + 360.0 * unit(rng);
+    surfacePoint(latitudes[i], longitudes[i], x[i], y[i], z[i]);
+    names[i] = syntheticName(rng);
+    if (!taken.insert(names[i]).second)
+    {
+      names[i] += " " + to_string(i);
+      taken.insert(names[i]);
+    }
+    codes[i].assign(codeLength, 'A');
+    for (int c = codeLength - 1, v = i; c >= 0; c--, v /= 26)
+    {
+      codes[i][c] = (char)('A' + v % 26);
+    }
+    double size = normal(rng);
+    areas[i] = llround(clamp(exp(11.5 + 1.6 * size), 1.0, 17e6));
+    populations[i] = llround(clamp(exp(15.4 + 1.0 * size + 1.2 * normal(rng)), 1000.0, 1.4e9));
+  }
+
+  SpatialIndex index;
+  index.build(x, y, z);
+  vector<pair<int, int>> borders;
+  vector<pair<double, int>> candidates;
+  for (int i = 0; i < n; i++)
+  {
+    index.nearest(x[i], y[i], z[i], 13, candidates);
+    for (auto &candidate : candidates)
+    {
+      int j = candidate.second;
+      if (j == i)
+        continue;
+      bool gabriel = true;
+      for (auto &other : candidates)
+      {
+        int k = other.second;
+        if (k == i || k == j)
+          continue;
+        double dx = x[j] - x[k], dy = y[j] - y[k], dz = z[j] - z[k];
+        if (other.first + dx * dx + dy * dy + dz * dz < candidate.first)
+        {
+          gabriel = false;
+          break;
+        }
+      }
+      if (gabriel)
+        borders.push_back(minmax(i, j));
+    }
+  }
+  sort(borders.begin(), borders.end());
+  borders.erase(unique(borders.begin(), borders.end()), borders.end());
+  vector<int> offsets(n + 1, 0), neighbors(2 * borders.size());
+  for (auto &border : borders)
+  {
+    offsets[border.first + 1]++;
+    offsets[border.second + 1]++;
+  }
+  partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  vector<int> next(offsets.begin(), offsets.end() - 1);
+  for (auto &border : borders)
+  {
+    neighbors[next[border.first]++] = border.second;
+    neighbors[next[border.second]++] = border.first;
+  }
+
+  FILE *file = fopen(fileName.c_str(), "wb");
+  if (file == nullptr)
+    return false;
+  string out = "Code,Country,latitude,longitude,Population,Boarding Countries,Area (km2)\n";
+  char number[32];
+  for (int i = 0; i < n; i++)
+  {
+    out += codes[i];
+    out += ',';
+    out += names[i];
+    snprintf(number, sizeof(number), ",%.6f,%.6f,", latitudes[i], longitudes[i]);
+    out += number;
+    out += to_string(populations[i]);
+    out += ",\"\"\"";
+    for (int e = offsets[i]; e < offsets[i + 1]; e++)
+    {
+      out += names[neighbors[e]];
+      out += ',';
+    }
+    out += "\"\"\",";
+    out += to_string(areas[i]);
+    out += '\n';
+    if (out.size() > (1 << 20))
+    {
+      fwrite(out.data(), 1, out.size(), file);
+      out.clear();
+    }
+  }
+  fwrite(out.data(), 1, out.size(), file);
+  return fclose(file) == 0;
+}
+
+// The whole pipeline on generated CSVs: load, border edges and graph
+// construction, then per call times of the menu operations. dijkstra and the
+// traversals print their results, which goes to nowhere while timed; prims is
+// timed without its prompt for how to print the tree.
+void benchmarkSuite(vector<int> sizes)
+{
+  string fileName = "countries_suite.csv";
+  streambuf *console = cout.rdbuf();
+  for (int n : sizes)
+  {
+    auto start = chrono::steady_clock::now();
+    if (!writeSyntheticCountries(fileName, n, n))
+    {
+      cout << "Could not write " << fileName << endl;
+      return;
+    }
+    double generateMs = elapsedMs(start);
+    double megabytes = MappedFile(fileName).data().size() / (1024.0 * 1024.0);
+
+    start = chrono::steady_clock::now();
+    NodeTable nodes = loadCountries(fileName);
+    double loadMs = elapsedMs(start);
+    start = chrono::steady_clock::now();
+    vector<tuple<int, int, int>> weightedEdges = borderEdges(nodes);
+    double edgesMs = elapsedMs(start);
+    start = chrono::steady_clock::now();
+    Graph graph(nodes, weightedEdges);
+    double graphMs = elapsedMs(start);
+
+    // Lookups by name and by code, and searches for pieces of names
+    mt19937 rng(1);
+    vector<string> keys, queries;
+    for (int q = 0; q < 10000; q++)
+    {
+      int id = rng() % n;
+      keys.push_back(string(q % 2 ? nodes.code(id) : nodes.name(id)));
+    }
+    for (int q = 0; q < 1000; q++)
+    {
+      string name(nodes.name(rng() % n));
+      size_t length = min(name.size(), (size_t)(3 + rng() % 4));
+      queries.push_back(name.substr(rng() % (name.size() - length + 1), length));
+    }
+    start = chrono::steady_clock::now();
+    int found = 0;
+    for (auto &key : keys)
+    {
+      found += graph.findCountry(key) != -1;
+    }
+    double findUs = elapsedMs(start) * 1000.0 / keys.size();
+    start = chrono::steady_clock::now();
+    for (auto &query : queries)
+    {
+      graph.searchCountries(query, 10);
+    }
+    double searchUs = elapsedMs(start) * 1000.0 / queries.size();
+
+    int filters = 100;
+    start = chrono::steady_clock::now();
+    for (int q = 0; q < filters; q++)
+    {
+      RangeFilter filter;
+      filter.minPopulation = rng() % 10000000;
+      filter.maxArea = filter.minPopulation / 10 + rng() % 1000000;
+      graph.filterCountries(filter);
+    }
+    double filterMs = elapsedMs(start) / filters;
+
+    int paths = 20, trees = 3;
+    cout.rdbuf(nullptr);
+    start = chrono::steady_clock::now();
+    for (int q = 0; q < paths; q++)
+    {
+      graph.dijkstra(rng() % n, rng() % n);
+    }
+    double dijkstraMs = elapsedMs(start) / paths;
+    double primsMs = 0, bfsMs = 0, dfsMs = 0;
+    PrimBuffers tree;
+    for (int q = 0; q < trees; q++)
+    {
+      int source = rng() % n;
+      start = chrono::steady_clock::now();
+      graph.primTree(source, tree);
+      primsMs += elapsedMs(start) / trees;
+      start = chrono::steady_clock::now();
+      graph.bfsTraversal(source);
+      bfsMs += elapsedMs(start) / trees;
+      start = chrono::steady_clock::now();
+      graph.dfsTraversal(source);
+      dfsMs += elapsedMs(start) / trees;
+    }
+    cout.rdbuf(console);
+    cout.clear();
+
+    cout << "nodes: " << n << "  borders: " << weightedEdges.size() << "  csv: " << megabytes << " MB (generated in " << generateMs << " ms)" << endl;
+    cout << "  load: " << loadMs << " ms  edges: " << edgesMs << " ms  graph: " << graphMs << " ms" << endl;
+    cout << "  find: " << findUs << " us (" << found << "/" << keys.size() << " found)  search: " << searchUs << " us  filter: " << filterMs << " ms" << endl;
+    cout << "  dijkstra: " << dijkstraMs << " ms  prims: " << primsMs << " ms  bfs: " << bfsMs << " ms  dfs: " << dfsMs << " ms" << endl;
+  }
+  remove(fileName.c_str());
+}
+
+// A graph's adjacency repacked with other weight and id widths for the
+// templated kernels. Weights are recomputed from the country positions, so
+// float and double keep the fractional km that Graph's int weights drop.
+template <typename Weight, typename Id>
+struct WeightedCsr
+{
+  int numberOfNodes = 0;
+  vector<int> offsets;
+  vector<Id> neighbors;
+  vector<Weight> weights;
+
+  // False when the graph has more nodes than Id can number
+  bool build(Graph &graph)
+  {
+    if ((size_t)graph.numberOfNodes > IdTraits<Id>::maxNodes)
+      return false;
+    numberOfNodes = graph.numberOfNodes;
+    offsets = graph.offsets;
+    neighbors.assign(graph.neighbors.begin(), graph.neighbors.end());
+    vector<int> from(graph.neighbors.size());
+    for (int v = 0; v < numberOfNodes; v++)
+    {
+      fill(from.begin() + offsets[v], from.begin() + offsets[v + 1], v);
+    }
+    GeoColumns points;
+    points.assign(graph.nodes.latitudes, graph.nodes.longitudes);
+    vector<double> km(from.size());
+    haversinePairs(points, from.data(), graph.neighbors.data(), from.size(), km.data());
+    weights.resize(km.size());
+    for (size_t e = 0; e < km.size(); e++)
+    {
+      weights[e] = WeightTraits<Weight>::fromKm(km[e]);
+    }
+    return true;
+  }
+
+  CsrView<Weight, Id> view()
+  {
+    return {numberOfNodes, offsets.data(), neighbors.data(), weights.data()};
+  }
+
+  size_t bytes()
+  {
+    return offsets.size() * sizeof(int) + neighbors.size() * sizeof(Id) + weights.size() * sizeof(Weight);
+  }
+};
 
-  Node()
+// Dijkstra queries and Prim's trees over graph at one weight and id width.
+// exact holds the double weight distances of queries (filled on the first,
+// double, call) and each width reports how far its distances are from them.
+template <typename Weight, typename Id>
+void benchmarkWidth(const char *name, Graph &graph, vector<pair<int, int>> &queries, vector<double> &exact)
+{
+  WeightedCsr<Weight, Id> csr;
+  if (!csr.build(graph))
   {
+    cout << "  " << name << ": too many nodes for the id type" << endl;
+    return;
   }
+  typedef typename WeightTraits<Weight>::Distance Distance;
+  BasicPathBuffers<Weight, Id> path;
+  BasicPrimBuffers<Weight, Id> tree;
+  auto noBound = [](Id)
+  { return (Distance)0; };
 
-  Node(int id, string code, string name, double latitude, double longitude, int population, int area, vector<string> adjacentCountries)
+  vector<double> found(queries.size());
+  for (int round = 0; round < 2; round++)
   {
-    this->id = id;
-    this->code = code;
-    this->name = name;
-    this->latitude = latitude;
-    this->longitude = longitude;
-    this->population = population;
-    this->area = area;
-    this->adjacentCountries = adjacentCountries;
+    // The first round sizes the buffers
+    auto start = chrono::steady_clock::now();
+    for (size_t q = 0; q < queries.size(); q++)
+    {
+      Id destination = queries[q].second;
+      bestFirstSearch(csr.view(), (Id)queries[q].first, destination, noBound, path);
+      Distance distance = path.distanceTo(destination);
+      found[q] = distance == WeightTraits<Weight>::infinity ? -1 : (double)distance;
+    }
+    double searchUs = elapsedMs(start) * 1000.0 / queries.size();
+    int trees = 5;
+    start = chrono::steady_clock::now();
+    for (int t = 0; t < trees; t++)
+    {
+      primKernel(csr.view(), (Id)queries[t].first, tree);
+    }
+    double primMs = elapsedMs(start) / trees;
+    if (round == 0)
+      continue;
+
+    if (exact.empty())
+      exact = found;
+    double worst = 0;
+    for (size_t q = 0; q < queries.size(); q++)
+    {
+      worst = max(worst, abs(found[q] - exact[q]));
+    }
+    size_t labelBytes = sizeof(Distance) + sizeof(Id) + sizeof(uint32_t);
+    cout << "  " << name << ": adjacency " << csr.bytes() / 1024.0 << " KB, labels " << labelBytes << " B/node  dijkstra: " << searchUs
+         << " us/query  prim: " << primMs << " ms  largest distance error: " << worst << " km" << endl;
   }
-  void displayNode()
+}
+
+// The search kernels instantiated for each supported weight and id width on
+// a map small enough for cache and one at the 16 bit id limit
+void benchmarkWidths()
+{
+  int sizes[] = {4000, 65000};
+  for (int n : sizes)
   {
-    cout << id << ". " << name << " (" << code << ")" << endl;
-    cout << "Population: " << this->population << endl;
-    cout << "Area in KM square: " << this->area << endl;
-    cout << "Adjacent Countries: ";
-    for (auto &c : adjacentCountries)
+    NodeTable nodes;
+    vector<tuple<int, int, int>> weightedEdges;
+    syntheticGraph(n, nodes, weightedEdges);
+    Graph graph(nodes, weightedEdges);
+    mt19937 rng(n);
+    vector<pair<int, int>> queries(n > 10000 ? 100 : 1000);
+    for (auto &query : queries)
     {
-      if (c == adjacentCountries[adjacentCountries.size() - 1])
-        cout << c;
-      else
-        cout << c << ", ";
+      query = make_pair((int)(rng() % n), (int)(rng() % n));
     }
-    cout << endl
-         << endl;
+    vector<double> exact;
+    cout << "nodes: " << n << "  edges: " << graph.neighbors.size() << endl;
+    benchmarkWidth<double, uint32_t>("double weights, uint32 ids", graph, queries, exact);
+    benchmarkWidth<float, uint32_t>("float weights, uint32 ids", graph, queries, exact);
+    benchmarkWidth<float, uint16_t>("float weights, uint16 ids", graph, queries, exact);
+    benchmarkWidth<int, int>("int weights, int ids (Graph)", graph, queries, exact);
+    benchmarkWidth<uint32_t, uint32_t>("uint32 weights, uint32 ids", graph, queries, exact);
+    benchmarkWidth<uint32_t, uint16_t>("uint32 weights, uint16 ids", graph, queries, exact);
+    benchmarkWidth<uint16_t, uint16_t>("uint16 weights, uint16 ids", graph, queries, exact);
   }
-  void displayNode(int count)
+}
+
+#ifdef COUNT_ALLOCATIONS
+// Runs each kind of graph query twice over the same inputs on a synthetic map
+// and counts the heap allocations of the second round, made once the thread's
+// QueryScratch has grown to size. Prints the counts and returns the total of
+// the second rounds, which should be 0.
+uint64_t checkAllocations()
+{
+  int n = 2000;
+  NodeTable nodes;
+  vector<tuple<int, int, int>> weightedEdges;
+  syntheticGraph(n, nodes, weightedEdges);
+  Graph graph(nodes, weightedEdges);
+  graph.buildLandmarks(8);
+  graph.buildHierarchy();
+  mt19937 rng(1);
+  vector<pair<int, int>> queries(200);
+  for (auto &query : queries)
   {
-    cout << count << ". " << name << " (" << code << ")" << endl;
-    cout << "Population: " << this->population << endl;
-    cout << "Area in KM square: " << this->area << endl;
-    cout << "Adjacent Countries: ";
-    for (auto &c : adjacentCountries)
+    query = make_pair((int)(rng() % n), (int)(rng() % n));
+  }
+
+  QueryScratch &scratch = threadScratch();
+  uint64_t total = 0;
+  auto check = [&](const char *name, auto run)
+  {
+    uint64_t counts[2];
+    for (int round = 0; round < 2; round++)
     {
-      if (c == adjacentCountries[adjacentCountries.size() - 1])
-        cout << c;
-      else
-        cout << c << ", ";
+      uint64_t before = threadAllocations;
+      for (auto &query : queries)
+      {
+        run(query.first, query.second);
+      }
+      counts[round] = threadAllocations - before;
+    }
+    cout << name << ": " << counts[0] << " allocations warming up, " << counts[1] << " after" << endl;
+    total += counts[1];
+  };
+  check("alt", [&](int s, int t)
+        { graph.shortestPath(s, t, scratch.path, scratch.result); });
+  check("a*", [&](int s, int t)
+        { graph.goalDirectedSearch(s, t, false, scratch.path);
+          graph.pathTo(s, t, scratch.path, scratch.result); });
+  check("contraction hierarchy", [&](int s, int t)
+        { graph.hierarchy.query(s, t, scratch.result); });
+  check("prim", [&](int s, int)
+        { graph.primTree(s, scratch.tree); });
+  check("breadth first", [&](int s, int)
+        { graph.breadthFirst(s, scratch.traversal); });
+  check("depth first", [&](int s, int)
+        { graph.depthFirst(s, scratch.traversal); });
+  check("direction optimizing bfs", [&](int s, int)
+        { graph.directionOptimizingBfs(s, scratch.traversal); });
+  check("hop distance", [&](int s, int t)
+        { graph.hopDistance(s, t, scratch.traversal); });
+  graph.allPairsDijkstra();
+  check("all pairs table", [&](int s, int t)
+        { graph.shortestPath(s, t, scratch.path, scratch.result); });
+  cout << (total == 0 ? "no allocations in steady state" : "ALLOCATIONS IN STEADY STATE") << endl;
+  return total;
+}
+#endif
+
+// Mean id distance between the ends of an edge, the smaller the more of a
+// node's neighbours share its cache lines
+double meanEdgeSpan(Graph &graph)
+{
+  double span = 0;
+  for (int u = 0; u < graph.numberOfNodes; u++)
+  {
+    for (int e = graph.offsets[u]; e < graph.offsets[u + 1]; e++)
+    {
+      span += abs(graph.neighbors[e] - u);
     }
-    cout << endl
-         << endl;
   }
-};
+  return graph.neighbors.empty() ? 0 : span / graph.neighbors.size();
+}
 
-double toRadians(double degree)
+// Generated CSVs (rows in name order, scattered over the map like the real
+// dataset) loaded as they are and renumbered along a Hilbert curve or in
+// reverse Cuthill-McKee order. Every ordering answers the same queries,
+// picked by CSV row and mapped with countryWithId. bfs times the traversal
+// behind bfsTraversal without printing the names; dijkstra is timed with its
+// output discarded.
+void benchmarkReordering(vector<int> sizes)
 {
-  return degree * M_PI / 180.0;
+  string fileName = "countries_reorder.csv";
+  streambuf *console = cout.rdbuf();
+  for (int n : sizes)
+  {
+    if (!writeSyntheticCountries(fileName, n, n))
+    {
+      cout << "Could not write " << fileName << endl;
+      return;
+    }
+    NodeTable loaded = loadCountries(fileName);
+    vector<tuple<int, int, int>> loadedEdges = borderEdges(loaded);
+    mt19937 rng(1);
+    int paths = 20, trees = 5;
+    vector<pair<int, int>> queries(paths);
+    for (auto &query : queries)
+    {
+      query = make_pair((int)(rng() % n), (int)(rng() % n));
+    }
+    cout << "nodes: " << n << "  borders: " << loadedEdges.size() << endl;
+    for (const char *method : {"csv order", "hilbert", "rcm"})
+    {
+      NodeTable nodes = loaded;
+      vector<tuple<int, int, int>> weightedEdges = loadedEdges;
+      auto start = chrono::steady_clock::now();
+      if (strcmp(method, "csv order") != 0)
+      {
+        vector<int> order = strcmp(method, "hilbert") == 0 ? hilbertOrder(nodes) : cuthillMcKeeOrder(n, weightedEdges);
+        renumberCountries(nodes, weightedEdges, order);
+      }
+      double reorderMs = elapsedMs(start);
+      Graph graph(nodes, weightedEdges);
+
+      TraversalBuffers traversal;
+      PrimBuffers tree;
+      double bfsMs = 0, primsMs = 0;
+      for (int q = 0; q < trees; q++)
+      {
+        int source = graph.countryWithId(queries[q].first);
+        start = chrono::steady_clock::now();
+        graph.breadthFirst(source, traversal);
+        bfsMs += elapsedMs(start) / trees;
+        start = chrono::steady_clock::now();
+        graph.primTree(source, tree);
+        primsMs += elapsedMs(start) / trees;
+      }
+      cout.rdbuf(nullptr);
+      start = chrono::steady_clock::now();
+      for (auto &query : queries)
+      {
+        graph.dijkstra(graph.countryWithId(query.first), graph.countryWithId(query.second));
+      }
+      double dijkstraMs = elapsedMs(start) / paths;
+      cout.rdbuf(console);
+      cout.clear();
+
+      cout << "  " << method << ": reorder " << reorderMs << " ms  mean edge span " << meanEdgeSpan(graph) << "  bfs: " << bfsMs
+           << " ms  dijkstra: " << dijkstraMs << " ms  prims: " << primsMs << " ms" << endl;
+    }
+  }
+  remove(fileName.c_str());
 }
 
-// Function to calculate the Haversine distance between two points
-double haversineDistance(double lat1, double lon1, double lat2, double lon2)
+// Bounded cache of path and filter results for a graph, shared by concurrent
+// readers. Path entries hold the whole shortest path tree of a source, so
+// every later query from that source is answered from it; filter entries
+// hold the ids a set of bounds selects. Keys are spread over shards, each
+// with its own lock and a CLOCK ring: a hit sets the entry's reference bit,
+// and eviction sweeps the ring clearing bits until it finds an entry without
+// one. Entries remember the graph revision they were computed at and are
+// recomputed once an update moves it on. Results are handed out as
+// shared_ptrs, so eviction never frees one still in use.
+class ResultCache
 {
-  const double EarthRadius = 6371.0; // Earth radius in kilometers
+public:
+  struct Tree
+  {
+    vector<int> distance;
+    vector<int> parent;
+  };
 
-  // Convert degrees to radians
-  lat1 = toRadians(lat1);
-  lon1 = toRadians(lon1);
-  lat2 = toRadians(lat2);
-  lon2 = toRadians(lon2);
+  // refused counts results too big for a shard, which are returned uncached
+  atomic<uint64_t> pathHits{0}, pathMisses{0}, filterHits{0}, filterMisses{0}, refused{0};
 
-  // Calculate differences in coordinates
-  double dLat = lat2 - lat1;
-  double dLon = lon2 - lon1;
+  // The budget is split evenly over the shards, but into no more shards than
+  // leaves each room for several shortest path trees of the graph, so large
+  // maps trade lock spreading for trees that fit at all
+  ResultCache(Graph &graph, size_t capacityBytes = 64 << 20, int shardCount = 16)
+      : graph(graph), shards(max<size_t>(1, min<size_t>(shardCount, capacityBytes / (4 * treeBytes(graph)))))
+  {
+    for (auto &shard : shards)
+    {
+      shard.capacity = capacityBytes / shards.size();
+    }
+  }
 
-  // Haversine formula
-  double a = sin(dLat / 2) * sin(dLat / 2) +
-             cos(lat1) * cos(lat2) * sin(dLon / 2) * sin(dLon / 2);
-  double c = 2 * atan2(sqrt(a), sqrt(1 - a));
+  // Bytes a cached shortest path tree of graph takes
+  static size_t treeBytes(Graph &graph)
+  {
+    return max<size_t>(1, 2 * (size_t)graph.numberOfNodes * sizeof(int));
+  }
 
-  // Calculate distance
-  double distance = EarthRadius * c;
+  // Shortest path tree from source, computed with a full Dijkstra on a miss
+  shared_ptr<const Tree> tree(int source)
+  {
+    Key key = {};
+    key.words[0] = (uint64_t)source << 1;
+    shared_ptr<const void> found = lookup(key, graph.topologyRevision);
+    if (found)
+    {
+      pathHits++;
+      return static_pointer_cast<const Tree>(found);
+    }
+    pathMisses++;
+    auto computed = make_shared<Tree>();
+    vector<int> targets;
+    graph.dijkstraSearch(source, targets, computed->distance, computed->parent);
+    store(key, graph.topologyRevision, computed, treeBytes(graph));
+    return computed;
+  }
 
-  return distance;
-}
+  PathResult path(int source, int destination)
+  {
+    shared_ptr<const Tree> found = tree(source);
+    return graph.pathTo(source, destination, found->distance, found->parent);
+  }
 
-int findCountry(vector<Node> &nodes, string key);
+  // Ids selected by filter, see Graph::selectCountries
+  shared_ptr<const vector<int>> select(RangeFilter &filter)
+  {
+    // Normalized key: -0.0 and 0.0 are the same bound
+    double bounds[8] = {(double)filter.minPopulation, (double)filter.maxPopulation, (double)filter.minArea, (double)filter.maxArea,
+                        filter.minLatitude + 0.0, filter.maxLatitude + 0.0, filter.minLongitude + 0.0, filter.maxLongitude + 0.0};
+    Key key = {};
+    key.words[0] = 1;
+    memcpy(key.words + 1, bounds, sizeof(bounds));
+    shared_ptr<const void> found = lookup(key, graph.dataRevision);
+    if (found)
+    {
+      filterHits++;
+      return static_pointer_cast<const vector<int>>(found);
+    }
+    filterMisses++;
+    auto computed = make_shared<vector<int>>(graph.selectCountries(filter));
+    store(key, graph.dataRevision, computed, computed->size() * sizeof(int));
+    return computed;
+  }
 
-class PriorityQueue
-{
-public:
-  deque<Node> primarydq;
-  stack<Node> secondarys;
-  int priority;
-  PriorityQueue(int priority)
+  // Entries and bytes held over all shards
+  pair<size_t, size_t> usage()
   {
-    this->priority = priority;
+    size_t entries = 0, bytes = 0;
+    for (auto &shard : shards)
+    {
+      lock_guard<mutex> lock(shard.lock);
+      entries += shard.ring.size();
+      bytes += shard.bytes;
+    }
+    return {entries, bytes};
   }
-  void enqueue(Node node)
+
+  void clear()
   {
-    if (primarydq.empty())
+    for (auto &shard : shards)
     {
-      primarydq.push_back(node);
+      lock_guard<mutex> lock(shard.lock);
+      shard.ring.clear();
+      shard.slots.clear();
+      shard.bytes = 0;
+      shard.hand = 0;
     }
-    else
+  }
+
+private:
+  struct Key
+  {
+    uint64_t words[9]; // kind and source, then filter bounds
+
+    bool operator==(const Key &other) const
     {
-      bool condition;
-      if (this->priority == 0)
-        condition = !primarydq.empty() && primarydq.back().population > node.population;
-      else
-        condition = !primarydq.empty() && primarydq.back().area > node.area;
-      while (condition)
-      {
-        secondarys.push(primarydq.back());
-        primarydq.pop_back();
-        if (priority == 0)
-          condition = !primarydq.empty() && primarydq.back().population > node.population;
-        else
-          condition = !primarydq.empty() && primarydq.back().area > node.area;
-      }
-      primarydq.push_back(node);
-      while (!secondarys.empty())
-      {
-        primarydq.push_back(secondarys.top());
-        secondarys.pop();
-      }
+      return memcmp(words, other.words, sizeof(words)) == 0;
     }
+  };
+
+  struct KeyHash
+  {
+    size_t operator()(const Key &key) const
+    {
+      return hashText(string_view((const char *)key.words, sizeof(key.words)));
+    }
+  };
+
+  struct Entry
+  {
+    Key key;
+    uint64_t revision;
+    size_t bytes;
+    bool referenced;
+    shared_ptr<const void> value;
+  };
+
+  struct Shard
+  {
+    mutex lock;
+    vector<Entry> ring;
+    unordered_map<Key, size_t, KeyHash> slots; // key to ring index
+    size_t hand = 0;
+    size_t bytes = 0;
+    size_t capacity = 0;
+  };
+
+  Graph &graph;
+  vector<Shard> shards;
+
+  Shard &shardOf(const Key &key)
+  {
+    return shards[(KeyHash()(key) >> 32) % shards.size()];
   }
-  void display(bool ascend)
+
+  // Drops ring entry index, the last entry takes its place
+  void erase(Shard &shard, size_t index)
+  {
+    Entry &victim = shard.ring[index];
+    shard.bytes -= victim.bytes;
+    shard.slots.erase(victim.key);
+    if (index + 1 != shard.ring.size())
+    {
+      victim = move(shard.ring.back());
+      shard.slots[victim.key] = index;
+    }
+    shard.ring.pop_back();
+  }
+
+  shared_ptr<const void> lookup(const Key &key, uint64_t revision)
   {
+    Shard &shard = shardOf(key);
+    lock_guard<mutex> lock(shard.lock);
+    auto found = shard.slots.find(key);
+    if (found == shard.slots.end() || shard.ring[found->second].revision != revision)
+      return nullptr;
+    Entry &entry = shard.ring[found->second];
+    entry.referenced = true;
+    return entry.value;
+  }
 
-    int count = 0;
-    if (ascend)
+  void store(const Key &key, uint64_t revision, shared_ptr<const void> value, size_t bytes)
+  {
+    Shard &shard = shardOf(key);
+    lock_guard<mutex> lock(shard.lock);
+    // Out of date, or another thread got here first: replaced like a new
+    // entry, so a larger value still makes room for itself
+    auto found = shard.slots.find(key);
+    if (found != shard.slots.end())
+      erase(shard, found->second);
+    if (bytes > shard.capacity)
+    {
+      refused++;
+      instrumentation.count(CounterCacheRefused);
+      return;
+    }
+    while (!shard.ring.empty() && shard.bytes + bytes > shard.capacity)
     {
-      while (!primarydq.empty())
+      if (shard.hand >= shard.ring.size())
+        shard.hand = 0;
+      Entry &victim = shard.ring[shard.hand];
+      if (victim.referenced)
       {
-        count++;
-        primarydq.front().displayNode(count);
-        primarydq.pop_front();
+        victim.referenced = false;
+        shard.hand++;
+        continue;
       }
+      erase(shard, shard.hand);
     }
-    else
+    shard.slots[key] = shard.ring.size();
+    shard.ring.push_back({key, revision, bytes, false, value});
+    shard.bytes += bytes;
+  }
+};
+
+// Batch mode: one command per line, answered without prompts into a buffered
+// writer as JSON Lines or CSV. Country names may be quoted, and unquoted names
+// with spaces are split wherever both halves name a country.
+//   path <from> <to>
+//   filter [minPopulation=N] [maxPopulation=N] [minArea=N] [maxArea=N]
+//          [minLatitude=X] [maxLatitude=X] [minLongitude=X] [maxLongitude=X]
+//          [sort=population|area] [order=asc|desc] [limit=N]
+//   search <text>
+//   mst <country>
+//   stats                  result cache hit counts
+//   metrics                instrumentation counters, phases and latencies
+// Paths and filters go through a ResultCache, paths from the all pairs
+// table instead when it is loaded.
+// The query server (further down) speaks the same commands, one JSON line back per line sent.
+
+class OutputBuffer
+{
+public:
+  OutputBuffer(FILE *file) : file(file) {}
+  // Writes straight to a socket or pipe
+  OutputBuffer(int descriptor) : file(nullptr), descriptor(descriptor) {}
+  ~OutputBuffer()
+  {
+    flush();
+  }
+
+  OutputBuffer &operator<<(string_view text)
+  {
+    buffer.append(text);
+    if (buffer.size() >= (1 << 16))
+      flush();
+    return *this;
+  }
+  OutputBuffer &operator<<(char c)
+  {
+    buffer.push_back(c);
+    return *this;
+  }
+  OutputBuffer &operator<<(long long value)
+  {
+    char digits[24];
+    return *this << string_view(digits, to_chars(digits, digits + sizeof(digits), value).ptr - digits);
+  }
+  OutputBuffer &operator<<(int value)
+  {
+    return *this << (long long)value;
+  }
+  OutputBuffer &operator<<(double value)
+  {
+    char digits[32];
+    return *this << string_view(digits, to_chars(digits, digits + sizeof(digits), value).ptr - digits);
+  }
+
+  // text as a JSON string, or as a CSV field quoted when it needs to be
+  void json(string_view text)
+  {
+    buffer.push_back('"');
+    for (char c : text)
     {
-      while (!primarydq.empty())
+      if (c == '"' || c == '\\')
+      {
+        buffer.push_back('\\');
+        buffer.push_back(c);
+      }
+      else if ((unsigned char)c < 0x20)
+      {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        buffer.append(escaped);
+      }
+      else
       {
-        count++;
-        primarydq.back().displayNode(count);
-        primarydq.pop_back();
+        buffer.push_back(c);
       }
     }
+    buffer.push_back('"');
+  }
+  void csv(string_view text)
+  {
+    if (text.find_first_of(",\"\r\n") == text.npos)
+    {
+      buffer.append(text);
+      return;
+    }
+    buffer.push_back('"');
+    for (char c : text)
+    {
+      if (c == '"')
+        buffer.push_back('"');
+      buffer.push_back(c);
+    }
+    buffer.push_back('"');
+  }
+
+  void flush()
+  {
+    if (file != nullptr)
+    {
+      fwrite(buffer.data(), 1, buffer.size(), file);
+      fflush(file);
+    }
+#ifndef _WIN32
+    for (size_t sent = 0; file == nullptr && sent < buffer.size();)
+    {
+      ssize_t written = write(descriptor, buffer.data() + sent, buffer.size() - sent);
+      if (written <= 0)
+        break;
+      sent += written;
+    }
+#endif
+    buffer.clear();
   }
+
+private:
+  FILE *file;
+  int descriptor = -1;
+  string buffer;
 };
 
-class Graph
+// Splits a command line into words, a double quoted word may hold spaces
+vector<string_view> commandWords(string_view line)
+{
+  vector<string_view> words;
+  size_t i = 0;
+  while (i < line.size())
+  {
+    if (isspace((unsigned char)line[i]))
+    {
+      i++;
+      continue;
+    }
+    size_t start = i;
+    if (line[i] == '"')
+    {
+      size_t end = line.find('"', i + 1);
+      end = end == line.npos ? line.size() : end;
+      words.push_back(line.substr(i + 1, end - i - 1));
+      i = end + 1;
+      continue;
+    }
+    while (i < line.size() && !isspace((unsigned char)line[i]))
+    {
+      i++;
+    }
+    words.push_back(line.substr(start, i - start));
+  }
+  return words;
+}
+
+class BatchRunner
 {
 public:
-  vector<Node> nodes;
-  int numberOfNodes;
-  vector<vector<int>> adjacencyMatrix;
-  Graph(vector<Node> &nodes, vector<tuple<int, int, int>> &weightedEdges)
+  BatchRunner(Graph &graph, OutputBuffer &out, bool csv, QueryScratch &scratch, ResultCache &cache)
+      : graph(graph), out(out), csv(csv), scratch(scratch), cache(cache) {}
+
+  // Answers a single command as soon as it arrives (JSON output only)
+  void answer(string_view line, int lineNumber)
   {
-    this->nodes = nodes;
-    numberOfNodes = nodes.size();
-    // Initialize the adjacency matrix with infinity (assuming no direct connection)
-    for (int i = 0; i < nodes.size(); ++i)
+    vector<string_view> words = commandWords(line);
+    if (words.empty() || (!words[0].empty() && words[0][0] == '#'))
+      return;
+    Command command = {lineNumber, line, words};
+    dispatch(command);
+  }
+
+  void run(string_view text)
+  {
+    vector<Command> commands;
+    int lineNumber = 0;
+    while (!text.empty())
     {
-      vector<int> row(nodes.size(), INT_MAX);
-      adjacencyMatrix.push_back(row);
+      size_t end = text.find('\n');
+      string_view line = text.substr(0, end);
+      text = end == text.npos ? string_view() : text.substr(end + 1);
+      lineNumber++;
+      if (!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+      vector<string_view> words = commandWords(line);
+      if (!words.empty() && (words[0].empty() || words[0][0] != '#'))
+        commands.push_back({lineNumber, line, words});
     }
 
-    // Populate the adjacency matrix based on weighted edges
-    for (const auto &edge : weightedEdges)
+    if (csv)
+      out << "line,command,rank,country,from,value,error\n";
+    for (auto &command : commands)
     {
-      int from = get<0>(edge);
-      int to = get<1>(edge);
-      int cost = get<2>(edge);
-      adjacencyMatrix[from][to] = cost;
-      // If the graph is undirected, uncomment the line below
-      adjacencyMatrix[to][from] = cost;
+      dispatch(command);
     }
+    out.flush();
   }
 
-  void displayCountry(int countryId)
+private:
+  struct Command
+  {
+    int line;
+    string_view text;
+    vector<string_view> words;
+  };
+
+  Graph &graph;
+  OutputBuffer &out;
+  bool csv;
+  QueryScratch &scratch;
+  ResultCache &cache;
+
+  void dispatch(Command &command)
+  {
+    ScopedTimer timer("command", LatencyCommand);
+    string_view name = command.words[0];
+    if (name == "path")
+      path(command);
+    else if (name == "filter")
+      filter(command);
+    else if (name == "search")
+      search(command);
+    else if (name == "mst")
+      spanningTree(command);
+    else if (name == "stats")
+      stats(command);
+    else if (name == "metrics")
+      metrics(command);
+    else
+      error(command, "unknown command");
+  }
+
+  // The words after the command as one country name
+  int countryAfter(vector<string_view> &words)
+  {
+    if (words.size() < 2)
+      return -1;
+    string_view first = words[1], last = words.back();
+    return graph.findCountry(string_view(first.data(), last.data() + last.size() - first.data()));
+  }
+
+  // Source and destination of a path command, (-1, -1) if they cannot be found
+  pair<int, int> countryPair(vector<string_view> &words)
   {
-    cout << countryId << ". " << nodes[countryId].name << " (" << nodes[countryId].code << ")" << endl;
-    cout << "Population: " << nodes[countryId].population << endl;
-    cout << "Area in KM square: " << nodes[countryId].area << endl;
-    for (int j = 0; j < adjacencyMatrix.size(); j++)
+    for (size_t split = 2; split < words.size(); split++)
     {
-      if (adjacencyMatrix[nodes[countryId].id][j] != INT_MAX)
-      {
-        cout << nodes[j].name << ": " << to_string(adjacencyMatrix[nodes[countryId].id][j]) << "km -- ";
-      }
+      string_view from(words[1].data(), words[split - 1].data() + words[split - 1].size() - words[1].data());
+      string_view to(words[split].data(), words.back().data() + words.back().size() - words[split].data());
+      int source = graph.findCountry(from), destination = graph.findCountry(to);
+      if (source != -1 && destination != -1)
+        return {source, destination};
     }
-    cout << "N/A" << endl
-         << endl;
+    return {-1, -1};
   }
 
-  void displayCountries()
+  void begin(Command &command)
+  {
+    out << "{\"line\":" << command.line << ",\"command\":";
+    out.json(command.words[0]);
+  }
+
+  void row(Command &command, int rank, string_view country, string_view from, long long value)
+  {
+    out << command.line << ',' << command.words[0] << ',' << rank << ',';
+    out.csv(country);
+    out << ',';
+    out.csv(from);
+    out << ',' << value << ",\n";
+  }
+
+  void error(Command &command, string_view message)
   {
-    for (int i = 0; i < adjacencyMatrix.size(); i++)
+    if (csv)
     {
-      displayCountry(i);
+      out << command.line << ',';
+      out.csv(command.words[0]);
+      out << ",,,,,";
+      out.csv(message);
+      out << '\n';
+      return;
     }
+    begin(command);
+    out << ",\"error\":";
+    out.json(message);
+    out << "}\n";
   }
 
-  void searchCountries(string query)
+  void path(Command &command)
   {
-    transform(query.begin(), query.end(), query.begin(), [](unsigned char c)
-              { return tolower(c); });
-    for (auto &node : nodes)
+    pair<int, int> ends = countryPair(command.words);
+    if (ends.first == -1)
     {
-      string countryName = node.name;
-      transform(countryName.begin(), countryName.end(), countryName.begin(), [](unsigned char c)
-                { return tolower(c); });
-      if (countryName.find(query) != countryName.npos)
+      error(command, "expected two known countries");
+      return;
+    }
+    PathResult result;
+    {
+      // Answered from the table or the cache, not through shortestPath, so timed here
+      ScopedTimer timer("shortest path", LatencyPath);
+      result = graph.allPairs.numberOfNodes == graph.numberOfNodes ? graph.allPairs.path(ends.first, ends.second)
+                                                                   : cache.path(ends.first, ends.second);
+    }
+    NodeTable &nodes = graph.nodes;
+    if (csv)
+    {
+      // One row per stop with the distance travelled so far
+      long long travelled = 0;
+      for (size_t i = 0; i < result.path.size(); i++)
       {
-        displayCountry(node.id);
+        if (i > 0)
+          travelled += graph.edgeWeight(result.path[i - 1], result.path[i]);
+        row(command, i, nodes.name(result.path[i]), i > 0 ? nodes.name(result.path[i - 1]) : "", travelled);
       }
+      if (result.path.empty())
+        error(command, "no path");
+      return;
     }
+    begin(command);
+    out << ",\"from\":";
+    out.json(nodes.name(result.source));
+    out << ",\"to\":";
+    out.json(nodes.name(result.destination));
+    out << ",\"distance\":";
+    if (result.distance == INT_MAX)
+      out << "null";
+    else
+      out << result.distance;
+    out << ",\"path\":[";
+    for (size_t i = 0; i < result.path.size(); i++)
+    {
+      if (i > 0)
+        out << ',';
+      out.json(nodes.name(result.path[i]));
+    }
+    out << "]}\n";
   }
 
-  vector<PriorityQueue> filterCountries(bool populationFlag, int populationLimit, bool areaFlag, int areaLimit)
+  void filter(Command &command)
   {
-    PriorityQueue populationq(0);
-    PriorityQueue areaq(1);
-    for (auto &node : nodes)
+    RangeFilter bounds;
+    bool byArea = false, ascending = false;
+    int limit = INT_MAX;
+    for (size_t i = 1; i < command.words.size(); i++)
     {
-      if (populationFlag && areaFlag)
-      {
-        if (node.population >= populationLimit && node.area >= areaLimit)
-        {
-          populationq.enqueue(node);
-          areaq.enqueue(node);
-        }
-      }
-      else if (populationFlag && !areaFlag)
+      string_view word = command.words[i];
+      size_t equals = word.find('=');
+      string_view key = word.substr(0, equals);
+      string value(equals == word.npos ? "" : word.substr(equals + 1));
+      char *end = nullptr;
+      double number = strtod(value.c_str(), &end);
+      bool numeric = !value.empty() && *end == '\0' && !isnan(number);
+      // Clamped to int before converting; a bound past the range selects nothing
+      // or everything, a fractional one is rounded inwards
+      auto lower = [&]()
+      { return (int)max((double)INT_MIN, min(ceil(number), (double)INT_MAX)); };
+      auto upper = [&]()
+      { return (int)max((double)INT_MIN, min(floor(number), (double)INT_MAX)); };
+      if (key == "sort" && (value == "population" || value == "area"))
+        byArea = value == "area";
+      else if (key == "order" && (value == "asc" || value == "desc"))
+        ascending = value == "asc";
+      else if (key == "limit" && numeric)
+        limit = max(0.0, min(number, (double)INT_MAX));
+      else if (key == "minPopulation" && numeric)
+        bounds.minPopulation = lower();
+      else if (key == "maxPopulation" && numeric)
+        bounds.maxPopulation = upper();
+      else if (key == "minArea" && numeric)
+        bounds.minArea = lower();
+      else if (key == "maxArea" && numeric)
+        bounds.maxArea = upper();
+      else if (key == "minLatitude" && numeric)
+        bounds.minLatitude = number;
+      else if (key == "maxLatitude" && numeric)
+        bounds.maxLatitude = number;
+      else if (key == "minLongitude" && numeric)
+        bounds.minLongitude = number;
+      else if (key == "maxLongitude" && numeric)
+        bounds.maxLongitude = number;
+      else
       {
-        bool condition;
-        if (areaLimit == -1)
-          condition = node.population <= populationLimit;
-        else
-          condition = node.population >= populationLimit && node.area <= areaLimit;
-        if (condition)
-        {
-          populationq.enqueue(node);
-          areaq.enqueue(node);
-        }
+        error(command, "bad filter term " + string(word));
+        return;
       }
-      else if (!populationFlag && areaFlag)
+    }
+    shared_ptr<const vector<int>> matching = cache.select(bounds);
+    PriorityQueue queue(graph.nodes, byArea ? 1 : 0);
+    vector<int> selected(matching->begin(), matching->end());
+    queue.fill(selected);
+    if (ascending)
+    {
+      vector<int> &order = queue.ordered();
+      selected.assign(order.begin(), order.begin() + min(limit, (int)order.size()));
+    }
+    else
+    {
+      selected = queue.topK(limit);
+    }
+
+    NodeTable &nodes = graph.nodes;
+    if (csv)
+    {
+      for (size_t i = 0; i < selected.size(); i++)
       {
-        bool condition;
-        if (populationLimit == -1)
-          condition = node.area <= areaLimit;
-        else
-          condition = (node.population <= populationLimit) && (node.area >= areaLimit);
-        if (condition)
-        {
-          populationq.enqueue(node);
-          areaq.enqueue(node);
-        }
+        row(command, i + 1, nodes.name(selected[i]), "", queue.key(selected[i]));
       }
-      else
+      return;
+    }
+    begin(command);
+    out << ",\"count\":" << (int)selected.size() << ",\"countries\":[";
+    for (size_t i = 0; i < selected.size(); i++)
+    {
+      int id = selected[i];
+      out << (i > 0 ? ",{\"name\":" : "{\"name\":");
+      out.json(nodes.name(id));
+      out << ",\"code\":";
+      out.json(nodes.code(id));
+      out << ",\"population\":" << nodes.populations[id] << ",\"area\":" << nodes.areas[id] << '}';
+    }
+    out << "]}\n";
+  }
+
+  void stats(Command &command)
+  {
+    pair<size_t, size_t> usage = cache.usage();
+    uint64_t counters[5] = {cache.pathHits, cache.pathMisses, cache.filterHits, cache.filterMisses, cache.refused};
+    if (csv)
+    {
+      const char *names[5] = {"pathHits", "pathMisses", "filterHits", "filterMisses", "refused"};
+      for (int i = 0; i < 5; i++)
       {
-        bool condition;
-        if (populationLimit == -1 && areaLimit == -1)
-          condition = true;
-        else if (populationLimit == -1 && areaLimit != -1)
-          condition = node.area <= areaLimit;
-        else if (populationLimit != -1 && areaLimit == -1)
-          condition = node.population <= populationLimit;
-        else
-          condition = node.population <= populationLimit && node.area <= areaLimit;
-        if (condition)
-        {
-          populationq.enqueue(node);
-          areaq.enqueue(node);
-        }
+        row(command, i + 1, names[i], "", counters[i]);
       }
+      return;
     }
-    return {populationq, areaq};
+    begin(command);
+    out << ",\"pathHits\":" << (long long)counters[0] << ",\"pathMisses\":" << (long long)counters[1]
+        << ",\"filterHits\":" << (long long)counters[2] << ",\"filterMisses\":" << (long long)counters[3]
+        << ",\"refused\":" << (long long)counters[4] << ",\"entries\":" << (long long)usage.first << ",\"bytes\":" << (long long)usage.second << "}\n";
   }
 
-  void bfsTraversal(int vertex)
+  void metrics(Command &command)
   {
-    if (vertex >= numberOfNodes || vertex < 0)
+    if (csv)
+    {
+      error(command, "metrics is JSON only");
+      return;
+    }
+    begin(command);
+    out << ",\"metrics\":" << instrumentation.json() << "}\n";
+  }
+
+  void search(Command &command)
+  {
+    if (command.words.size() < 2)
     {
+      error(command, "expected search text");
       return;
     }
-    vector<bool> visited(numberOfNodes, false);
-    queue<int> q;
-    q.push(vertex);
-    while (q.empty() == false)
+    string_view first = command.words[1], last = command.words.back();
+    string_view query(first.data(), last.data() + last.size() - first.data());
+    // Same as the menu: every name containing the text, else the closest few
+    // (one typo allowed per four characters, none below four)
+    vector<int> matches = graph.searchCountries(query, INT_MAX, 0, scratch.search);
+    int maxEdits = min(2, (int)query.size() / 4);
+    bool fuzzy = matches.empty() && maxEdits > 0;
+    if (fuzzy)
+      matches = graph.searchCountries(query, 10, maxEdits, scratch.search);
+
+    NodeTable &nodes = graph.nodes;
+    if (csv)
     {
-      vertex = q.front();
-      q.pop();
-      if (visited[vertex] == false)
+      for (size_t i = 0; i < matches.size(); i++)
       {
-        visited[vertex] = true;
-        cout << nodes[vertex].name << " -> ";
-        for (int i = 0; i < numberOfNodes; i++)
-        {
-          if (adjacencyMatrix[vertex][i] != INT_MAX)
-          {
-            q.push(i);
-          }
-        }
+        row(command, i + 1, nodes.name(matches[i]), "", fuzzy);
       }
+      return;
     }
-    cout << " N/A " << endl;
+    begin(command);
+    out << ",\"text\":";
+    out.json(query);
+    out << ",\"fuzzy\":" << (fuzzy ? "true" : "false") << ",\"countries\":[";
+    for (size_t i = 0; i < matches.size(); i++)
+    {
+      if (i > 0)
+        out << ',';
+      out.json(nodes.name(matches[i]));
+    }
+    out << "]}\n";
   }
-  void dfsTraversal(int vertex)
+
+  // Prim's minimum spanning tree of the country's part of the map, edges in
+  // the order they join it
+  void spanningTree(Command &command)
   {
-    if (vertex >= numberOfNodes || vertex < 0)
+    int root = countryAfter(command.words);
+    if (root == -1)
     {
+      error(command, "unknown country");
       return;
     }
-    vector<bool> visited(numberOfNodes, false);
-    stack<int> s;
-    s.push(vertex);
-    while (s.empty() == false)
+    PrimBuffers &tree = scratch.tree;
+    graph.primTree(root, tree);
+    vector<tuple<int, int, int>> edges; // (parent, child, weight)
+    long long total = 0;
+    for (size_t i = 1; i < tree.order.size(); i++)
     {
-      vertex = s.top();
-      s.pop();
-      if (visited[vertex] == false)
+      int v = tree.order[i];
+      edges.push_back(make_tuple(tree.parent[v], v, tree.distance[v]));
+      total += tree.distance[v];
+    }
+
+    NodeTable &nodes = graph.nodes;
+    if (csv)
+    {
+      for (size_t i = 0; i < edges.size(); i++)
       {
-        visited[vertex] = true;
-        cout << nodes[vertex].name << " -> ";
-        for (int i = 0; i < numberOfNodes; i++)
-        {
-          if (adjacencyMatrix[vertex][i] != INT_MAX)
-          {
-            s.push(i);
-          }
-        }
+        row(command, i + 1, nodes.name(get<1>(edges[i])), nodes.name(get<0>(edges[i])), get<2>(edges[i]));
       }
+      return;
     }
-    cout << " N/A " << endl;
+    begin(command);
+    out << ",\"root\":";
+    out.json(nodes.name(root));
+    out << ",\"totalWeight\":" << total << ",\"edges\":[";
+    for (size_t i = 0; i < edges.size(); i++)
+    {
+      out << (i > 0 ? ",[" : "[");
+      out.json(nodes.name(get<0>(edges[i])));
+      out << ',';
+      out.json(nodes.name(get<1>(edges[i])));
+      out << ',' << get<2>(edges[i]) << ']';
+    }
+    out << "]}\n";
   }
-  void printPrims(int parent[], int distance[], vector<Node> nodes, int source)
+};
+
+// Path and filter queries with popular sources and thresholds, answered
+// directly and through a ResultCache
+void benchmarkCache()
+{
+  // The larger map has trees bigger than an even split of the budget over 16 shards
+  int sizes[] = {100000, 1000000};
+  for (int n : sizes)
   {
-    // for (int i = 0; i < numberOfNodes; i++) {
-    //   if (parent[i] == -1) {
-    //     nodes[findCountry(nodes[i].adjacentCountries[0])]
-    //   }
-    // }
-    vector<tuple<int, int, int>> edges;
-    for (int i = 0; i < numberOfNodes; i++)
+    NodeTable nodes;
+    vector<tuple<int, int, int>> weightedEdges;
+    syntheticGraph(n, nodes, weightedEdges);
+    Graph graph(nodes, weightedEdges);
+    mt19937 rng(n);
+    // Nine queries in ten come from 32 popular sources
+    vector<pair<int, int>> queries(n > 500000 ? 500 : 10000);
+    vector<int> popular(32);
+    for (int &source : popular)
     {
-      if (distance[i] != INT_MAX && parent[i] != -1)
-      {
-        tuple<int, int, int> edge = make_tuple(i, parent[i], distance[i]);
-        edges.push_back(edge);
-      }
+      source = rng() % n;
     }
-    Graph minSpan(nodes, edges);
-    cout << "Press 0 to display minimum spanning tree with bfs traversal otherwise, press 1 to display in dfs traversal: ";
-    int option;
-    cin >> option;
-    cout << endl;
-    if (option == 0)
+    for (auto &query : queries)
     {
-      minSpan.bfsTraversal(source);
+      query.first = rng() % 10 < 9 ? popular[rng() % popular.size()] : rng() % n;
+      query.second = rng() % n;
     }
-    else if (option == 1)
+    long long checksum = 0;
+    auto start = chrono::steady_clock::now();
+    int direct = queries.size() / 10;
+    PathBuffers buffers;
+    PathResult result;
+    for (int i = 0; i < direct; i++)
     {
-      minSpan.dfsTraversal(source);
+      graph.shortestPath(queries[i].first, queries[i].second, buffers, result);
+      checksum += result.distance;
     }
-  }
+    double directMs = elapsedMs(start) / direct;
 
-  void printDijkstra(int parent[], int distance[], vector<Node> nodes, int destination)
-  {
-    string path = "";
-    cout << endl
-         << "Source :: ";
+    ResultCache cache(graph, 128 << 20);
+    long long cachedChecksum = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < (int)queries.size(); i++)
+    {
+      long long d = cache.path(queries[i].first, queries[i].second).distance;
+      if (i < direct)
+        cachedChecksum += d;
+    }
+    double cachedMs = elapsedMs(start) / queries.size();
+    cout << "nodes: " << n << "  paths: A* " << directMs << " ms/query, cached trees " << cachedMs << " ms/query, hit rate "
+         << 100.0 * cache.pathHits / (cache.pathHits + cache.pathMisses) << "%" << (checksum == cachedChecksum ? "" : "  (MISMATCH)") << endl;
 
-    int counter = 0;
-    int totalDistance = 0;
-    while (destination != -1)
+    // Filters over a handful of population thresholds
+    vector<RangeFilter> filters(n > 500000 ? 2000 : 20000);
+    for (auto &filter : filters)
     {
-      counter++;
-      path = nodes[destination].name + "  " + path;
-      totalDistance += distance[destination];
-      destination = parent[destination];
+      filter.minPopulation = 10000000 * (int)(rng() % 8);
+      filter.maxArea = 100000 * (int)(1 + rng() % 4);
     }
-    if (counter == 1)
+    size_t selected = 0;
+    start = chrono::steady_clock::now();
+    for (auto &filter : filters)
     {
-      cout << "The countries are not accessible by road ";
+      selected += graph.selectCountries(filter).size();
     }
-    else
+    directMs = elapsedMs(start) / filters.size();
+    size_t cachedSelected = 0;
+    start = chrono::steady_clock::now();
+    for (auto &filter : filters)
     {
-      cout << path;
+      cachedSelected += cache.select(filter)->size();
     }
-    cout << ":: Destination" << endl;
-    cout << "Total Distance: " << totalDistance << " KM" << endl;
+    cachedMs = elapsedMs(start) / filters.size();
+    cout << "  filters: direct " << directMs << " ms/query, cached " << cachedMs << " ms/query, hit rate "
+         << 100.0 * cache.filterHits / (cache.filterHits + cache.filterMisses) << "%" << (selected == cachedSelected ? "" : "  (MISMATCH)") << endl;
+    pair<size_t, size_t> usage = cache.usage();
+    cout << "  cache: " << usage.first << " entries, " << usage.second / (1024.0 * 1024.0) << " MB, " << cache.refused << " refused" << endl;
   }
-  int minimumUnvisitedNode(int distance[], bool visited[])
+}
+
+// Runs batch commands with known answers on the loaded countries and prints
+// each one that does not answer as expected. Returns the number of those.
+int checkBatch(Graph &graph)
+{
+  // Command, then text its JSON answer must contain
+  vector<pair<string, string>> cases = {
+      {"filter minPopulation=1e20 limit=2", "\"count\":0,"},
+      {"filter maxPopulation=-1e20", "\"count\":0,"},
+      {"filter minArea=1e20", "\"count\":0,"},
+      {"filter maxArea=-1e20", "\"count\":0,"},
+      {"filter minPopulation=-1e20 maxArea=1e20 limit=1", "\"count\":1,"},
+      {"filter minPopulation=375317.5 maxPopulation=375318.5", "\"count\":1,\"countries\":[{\"name\":\"Iceland\""},
+      {"filter minPopulation=375318.1 maxPopulation=375318.9", "\"count\":0,"},
+      {"filter minArea=100249.01 maxArea=100250.99", "\"count\":1,\"countries\":[{\"name\":\"Iceland\""},
+      {"search Qx", "\"fuzzy\":false,\"countries\":[]"},
+      {"search Icelamd", "\"fuzzy\":true,\"countries\":[\"Iceland\""},
+      {"\"\" path France Spain", "\"error\":\"unknown command\""},
+      {"\"", "\"error\":\"unknown command\""},
+  };
+  ResultCache cache(graph);
+  int failures = 0;
+  for (auto &[command, expected] : cases)
   {
-    int minimum;
-    int dist = INT_MAX;
-    for (int i = 0; i < numberOfNodes; i++)
+    FILE *file = tmpfile();
+    if (file == nullptr)
+      return -1;
     {
-      if (distance[i] <= dist && visited[i] == false)
-      {
-        dist = distance[i], minimum = i;
-      }
+      OutputBuffer out(file);
+      BatchRunner runner(graph, out, false, threadScratch(), cache);
+      runner.answer(command, 1);
     }
-    return minimum;
-  }
-  void dijkstra(int source, int destination, vector<Node> nodes)
-  {
-    int distance[numberOfNodes];
-    bool visited[numberOfNodes];
-    int parent[numberOfNodes];
-
-    for (int i = 0; i < numberOfNodes; i++)
+    string answer(ftell(file), '\0');
+    rewind(file);
+    answer.resize(fread(&answer[0], 1, answer.size(), file));
+    fclose(file);
+    if (answer.find(expected) == answer.npos)
     {
-      distance[i] = INT_MAX, visited[i] = false, parent[i] = -1;
+      cout << "FAILED " << command << ": " << answer;
+      failures++;
     }
+  }
+  cout << cases.size() - failures << " of " << cases.size() << " batch checks passed" << endl;
+  return failures;
+}
 
-    distance[source] = 0;
+#ifndef _WIN32
+// Listening or connected socket for an address: a port number means TCP on
+// 127.0.0.1, anything else the path of a Unix domain socket. -1 on failure.
+int openSocket(string address, bool listening)
+{
+  bool tcp = !address.empty() && all_of(address.begin(), address.end(), [](char c)
+                                        { return isdigit((unsigned char)c); });
+  int fd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  int result;
+  if (tcp)
+  {
+    sockaddr_in where = {};
+    where.sin_family = AF_INET;
+    where.sin_port = htons(stoi(address));
+    where.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (listening)
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    result = listening ? ::bind(fd, (sockaddr *)&where, sizeof(where)) : connect(fd, (sockaddr *)&where, sizeof(where));
+  }
+  else
+  {
+    sockaddr_un where = {};
+    where.sun_family = AF_UNIX;
+    strncpy(where.sun_path, address.c_str(), sizeof(where.sun_path) - 1);
+    if (listening)
+      unlink(address.c_str());
+    result = listening ? ::bind(fd, (sockaddr *)&where, sizeof(where)) : connect(fd, (sockaddr *)&where, sizeof(where));
+  }
+  if (result != 0 || (listening && listen(fd, 128) != 0))
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
 
-    for (auto i = 0; i < numberOfNodes - 1; i++)
-    {
-      int vertex = minimumUnvisitedNode(distance, visited);
+// Query server: a pool of worker threads answering batch mode commands over
+// a shared graph that no one updates while it runs. One thread polls the
+// listener and every open connection, splits what arrives into lines and
+// queues the connection while it has lines waiting. A worker answers one line
+// and puts the connection back at the end of the queue if more are waiting,
+// so any number of clients share the workers and one busy client cannot hold
+// a worker. A connection is on the queue at most once, which keeps its
+// answers in the order its lines were sent. Each worker keeps one
+// QueryScratch for all the queries it answers.
+class QueryServer
+{
+public:
+  QueryServer(Graph &graph) : graph(graph), cache(graph) {}
 
-      visited[vertex] = true;
+  bool listen(string address)
+  {
+    listener = openSocket(address, true);
+    return listener >= 0;
+  }
 
-      for (int j = 0; j < numberOfNodes; j++)
+  // Serves until the process is stopped
+  void run(int workers)
+  {
+    signal(SIGPIPE, SIG_IGN);
+    // Everything lazily built is built now, queries only read the graph
+    if (!graph.nameSearch.built())
+      graph.buildSearchIndex();
+    vector<thread> pool;
+    for (int i = 0; i < workers; i++)
+    {
+      pool.emplace_back([this]()
+                        { work(); });
+    }
+    // Connections still being read, in the same order as polled[1..]
+    vector<shared_ptr<Connection>> open;
+    vector<pollfd> polled;
+    char block[1 << 14];
+    while (true)
+    {
+      polled.assign(1, {listener, POLLIN, 0});
+      for (auto &connection : open)
       {
-        if (visited[j] == false && adjacencyMatrix[vertex][j] != INT_MAX && distance[vertex] != INT_MAX && distance[vertex] + adjacencyMatrix[vertex][j] < distance[j])
+        polled.push_back({connection->fd, POLLIN, 0});
+      }
+      if (poll(polled.data(), polled.size(), -1) < 0)
+        continue;
+      size_t kept = 0;
+      for (size_t i = 0; i < open.size(); i++)
+      {
+        shared_ptr<Connection> &connection = open[i];
+        ssize_t received = 1;
+        if (polled[i + 1].revents != 0)
         {
-          distance[j] = distance[vertex] + adjacencyMatrix[vertex][j];
-          parent[j] = vertex;
+          received = read(connection->fd, block, sizeof(block));
+          if (received > 0)
+            receive(connection, string_view(block, received));
+        }
+        if (received <= 0)
+          hangUp(connection);
+        else if (kept++ != i)
+          open[kept - 1] = move(connection);
+      }
+      open.resize(kept);
+      if (polled[0].revents & POLLIN)
+      {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd >= 0)
+        {
+          open.push_back(make_shared<Connection>());
+          open.back()->fd = fd;
         }
       }
     }
-    printDijkstra(parent, distance, nodes, destination);
   }
-  void prims(int source, vector<Node> nodes)
+
+private:
+  struct Connection
   {
-    int distance[numberOfNodes];
-    bool visited[numberOfNodes];
-    int parent[numberOfNodes];
+    int fd = -1;
+    string input;                   // bytes after the last complete line
+    int lineNumber = 0;             // lines received so far
+    deque<pair<int, string>> lines; // numbered lines waiting for an answer
+    bool queued = false;            // on the ready queue or being answered
+    bool finished = false;          // the client sent everything it will
+  };
 
-    for (int i = 0; i < numberOfNodes; i++)
+  Graph &graph;
+  ResultCache cache;
+  int listener = -1;
+  mutex queueLock;
+  condition_variable queueReady;
+  queue<shared_ptr<Connection>> ready;
+
+  // Queues every complete line in data for the connection
+  void receive(const shared_ptr<Connection> &connection, string_view data)
+  {
+    string &input = connection->input;
+    input.append(data);
+    size_t start = 0, end;
+    lock_guard<mutex> lock(queueLock);
+    while ((end = input.find('\n', start)) != input.npos)
+    {
+      size_t length = end - start;
+      if (length > 0 && input[end - 1] == '\r')
+        length--;
+      connection->lines.emplace_back(++connection->lineNumber, input.substr(start, length));
+      start = end + 1;
+    }
+    input.erase(0, start);
+    if (!connection->lines.empty() && !connection->queued)
     {
-      distance[i] = INT_MAX, visited[i] = false, parent[i] = -1;
+      connection->queued = true;
+      ready.push(connection);
+      queueReady.notify_one();
     }
+  }
 
-    distance[source] = 0;
+  // The client closed its end: the socket closes once its lines are answered
+  void hangUp(const shared_ptr<Connection> &connection)
+  {
+    lock_guard<mutex> lock(queueLock);
+    connection->finished = true;
+    if (!connection->queued)
+      close(connection->fd);
+  }
 
-    for (auto i = 0; i < numberOfNodes - 1; i++)
+  void work()
+  {
+    QueryScratch &scratch = threadScratch();
+    while (true)
     {
-      int vertex = minimumUnvisitedNode(distance, visited);
-
-      visited[vertex] = true;
+      shared_ptr<Connection> connection;
+      pair<int, string> line;
+      {
+        unique_lock<mutex> lock(queueLock);
+        queueReady.wait(lock, [this]()
+                        { return !ready.empty(); });
+        connection = move(ready.front());
+        ready.pop();
+        line = move(connection->lines.front());
+        connection->lines.pop_front();
+      }
+      OutputBuffer out(connection->fd);
+      BatchRunner runner(graph, out, false, scratch, cache);
+      runner.answer(line.second, line.first);
+      out.flush();
+      lock_guard<mutex> lock(queueLock);
+      if (!connection->lines.empty())
+      {
+        ready.push(move(connection));
+        queueReady.notify_one();
+      }
+      else
+      {
+        connection->queued = false;
+        if (connection->finished)
+          close(connection->fd);
+      }
+    }
+  }
+};
 
-      for (int j = 0; j < numberOfNodes; j++)
+// Closed loop load generator for a running server: each connection sends a
+// query, waits for its answer and sends the next, for the given time. The
+// mix is mostly paths between random countries with some searches, filters
+// and spanning trees. Prints QPS and latency percentiles.
+void runLoadGenerator(string address, NodeTable &nodes, int connections, double seconds)
+{
+  vector<vector<double>> latencies(connections);
+  atomic<int> failures(0);
+  auto deadline = chrono::steady_clock::now() + chrono::duration<double>(seconds);
+  vector<thread> clients;
+  for (int c = 0; c < connections; c++)
+  {
+    clients.emplace_back([&, c]()
+                         {
+      int fd = openSocket(address, false);
+      if (fd < 0)
+      {
+        failures++;
+        return;
+      }
+      mt19937 rng(c + 1);
+      string request, response;
+      char block[1 << 14];
+      while (chrono::steady_clock::now() < deadline)
       {
-        if (visited[j] == false && adjacencyMatrix[vertex][j] != INT_MAX && adjacencyMatrix[vertex][j] < distance[j])
+        int a = rng() % nodes.size(), b = rng() % nodes.size(), kind = rng() % 10;
+        if (kind < 7)
+          request = "path \"" + string(nodes.name(a)) + "\" \"" + string(nodes.name(b)) + "\"\n";
+        else if (kind == 7)
+          request = "search " + string(nodes.name(a).substr(0, 3)) + "\n";
+        else if (kind == 8)
+          request = "filter minPopulation=" + to_string(rng() % 10000000) + " limit=10\n";
+        else
+          request = "mst \"" + string(nodes.name(a)) + "\"\n";
+        auto start = chrono::steady_clock::now();
+        if (write(fd, request.data(), request.size()) != (ssize_t)request.size())
+          break;
+        response.clear();
+        ssize_t received = 0;
+        while (response.find('\n') == response.npos && (received = read(fd, block, sizeof(block))) > 0)
         {
-          distance[j] = adjacencyMatrix[vertex][j];
-          parent[j] = vertex;
+          response.append(block, received);
         }
+        if (received <= 0)
+          break;
+        latencies[c].push_back(elapsedMs(start));
       }
-    }
-    printPrims(parent, distance, nodes, source);
+      close(fd); });
   }
-};
+  for (auto &client : clients)
+  {
+    client.join();
+  }
+  vector<double> all;
+  for (auto &perClient : latencies)
+  {
+    all.insert(all.end(), perClient.begin(), perClient.end());
+  }
+  if (failures > 0)
+    cout << failures << " connection(s) to " << address << " failed" << endl;
+  if (all.empty())
+    return;
+  sort(all.begin(), all.end());
+  auto percentile = [&](double p)
+  { return all[min(all.size() - 1, (size_t)(p * all.size()))]; };
+  cout << connections << " connections, " << all.size() << " queries in " << seconds << " s: " << all.size() / seconds << " QPS" << endl;
+  cout << "  latency p50 " << percentile(0.5) << " ms, p99 " << percentile(0.99) << " ms, max " << all.back() << " ms" << endl;
+  // A connection left waiting behind the others shows up here as a low count
+  size_t fewest = all.size();
+  for (auto &perClient : latencies)
+  {
+    fewest = min(fewest, perClient.size());
+  }
+  cout << "  fewest queries on one connection: " << fewest << endl;
+  int fd = openSocket(address, false);
+  string stats = "stats\n";
+  char block[512];
+  ssize_t received;
+  if (fd >= 0 && write(fd, stats.data(), stats.size()) == (ssize_t)stats.size() && (received = read(fd, block, sizeof(block))) > 0)
+    cout << "  server: " << string_view(block, received);
+  if (fd >= 0)
+    close(fd);
+}
+#endif
 
-int findCountry(vector<Node> nodes, int start, int end, string key)
+int main(int argc, char *argv[])
 {
-  while (start <= end)
+  // --metrics <file> and --trace <file> may go anywhere and are written on exit.
+  // --reorder hilbert|rcm renumbers the countries read from the CSV.
+  static string metricsFile, traceFile;
+  string reorder;
+  int kept = 1;
+  for (int i = 1; i < argc; i++)
+  {
+    if (i + 1 < argc && strcmp(argv[i], "--metrics") == 0)
+      metricsFile = argv[++i];
+    else if (i + 1 < argc && strcmp(argv[i], "--trace") == 0)
+      traceFile = argv[++i];
+    else if (i + 1 < argc && strcmp(argv[i], "--reorder") == 0)
+      reorder = argv[++i];
+    else
+      argv[kept++] = argv[i];
+  }
+  argc = kept;
+  if (!traceFile.empty())
+    instrumentation.startTracing();
+  atexit([]
+         {
+           if (!metricsFile.empty())
+             ofstream(metricsFile) << instrumentation.json() << endl;
+           if (!traceFile.empty())
+             instrumentation.writeTrace(traceFile); });
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+  {
+    benchmarkGraph();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-reorder") == 0)
   {
-    int mid = (end + start) / 2;
-    if (nodes[mid].name.compare(key) == 0)
+    vector<int> sizes;
+    for (int i = 2; i < argc; i++)
     {
-      return mid;
+      sizes.push_back(atoi(argv[i]));
     }
-    if (nodes[mid].name.compare(key) > 0)
+    if (sizes.empty())
+      sizes = {100000, 1000000};
+    benchmarkReordering(sizes);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-widths") == 0)
+  {
+    benchmarkWidths();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--check-allocations") == 0)
+  {
+#ifdef COUNT_ALLOCATIONS
+    return checkAllocations() == 0 ? 0 : 1;
+#else
+    cout << "Allocation counting is not built in (build with -DCOUNT_ALLOCATIONS)" << endl;
+    return 1;
+#endif
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-suite") == 0)
+  {
+    vector<int> sizes;
+    for (int i = 2; i < argc; i++)
     {
-      end = mid - 1;
+      sizes.push_back(atoi(argv[i]));
     }
-    else
+    if (sizes.empty())
+      sizes = {1000, 10000, 100000};
+    benchmarkSuite(sizes);
+    return 0;
+  }
+  if (argc > 3 && strcmp(argv[1], "--generate") == 0)
+  {
+    int n = atoi(argv[3]);
+    unsigned seed = argc > 4 ? (unsigned)atoi(argv[4]) : 1;
+    if (n <= 0 || !writeSyntheticCountries(argv[2], n, seed))
     {
-      start = mid + 1;
+      cout << "Could not generate " << argv[2] << endl;
+      return 1;
     }
+    return 0;
   }
-  return -1;
-}
-int findCountry(vector<Node> &nodes, string key)
-{
-  for (Node n : nodes)
+  if (argc > 1 && strcmp(argv[1], "--bench-cache") == 0)
+  {
+    benchmarkCache();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-updates") == 0)
   {
-    if (n.name == key)
+    benchmarkUpdates();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-snapshot") == 0)
+  {
+    benchmarkSnapshot();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-traversal") == 0)
+  {
+    benchmarkTraversal();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-mst") == 0)
+  {
+    benchmarkSpanningForest();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-haversine") == 0)
+  {
+    benchmarkHaversine();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-spatial") == 0)
+  {
+    benchmarkSpatial();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-search") == 0)
+  {
+    benchmarkSearch();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-filter") == 0)
+  {
+    benchmarkFilter();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-rank") == 0)
+  {
+    benchmarkRanking();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-csv") == 0)
+  {
+    benchmarkLoader();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-astar") == 0)
+  {
+    benchmarkGoalDirected();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-ch") == 0)
+  {
+    benchmarkHierarchy();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-apsp") == 0)
+  {
+    benchmarkAllPairs();
+    return 0;
+  }
+
+  // Dataset reading, straight from a snapshot of the built graph when given one
+  bool fromSnapshot = argc > 1 && strcmp(argv[1], "--snapshot") == 0;
+  string snapshotFile = argc > 2 ? argv[2] : "world.snapshot";
+  NodeTable nodes;
+  GraphArrays arrays;
+  vector<tuple<int, int, int>> weightedEdges;
+  if (fromSnapshot && !loadSnapshot(snapshotFile, nodes, arrays))
+  {
+    cout << "Could not load snapshot " << snapshotFile << endl;
+    return 1;
+  }
+  if (!fromSnapshot)
+  {
+    nodes = loadCountries("world_coordinates.csv");
+    weightedEdges = borderEdges(nodes);
+    if (reorder == "hilbert" || reorder == "rcm")
+    {
+      vector<int> order = reorder == "hilbert" ? hilbertOrder(nodes) : cuthillMcKeeOrder(nodes.size(), weightedEdges);
+      renumberCountries(nodes, weightedEdges, order);
+    }
+    else if (!reorder.empty())
     {
-      return n.id;
+      cout << "Unknown --reorder " << reorder << ", expected hilbert or rcm" << endl;
+      return 1;
     }
   }
-  return -1;
-}
 
-int main()
-{
-  // Dataset reading
-  ifstream dataFile;
-  dataFile.open("world_coordinates.csv");
-  string line = "";
-  getline(dataFile, line);
-  line = "";
-  vector<Node> nodes;
-  int i = 0;
-  int errcount = 0;
-  while (getline(dataFile, line) && i < 300)
+  // Graph
+  Graph countriesGraph = fromSnapshot ? Graph(nodes, arrays) : Graph(nodes, weightedEdges);
+  if (argc > 1 && strcmp(argv[1], "--build-snapshot") == 0)
   {
-    int id;
-    string code;
-    string name;
-    double latitude;
-    double longitude;
-    int population;
-    int area;
-    vector<string> adjacentCountries;
-    string ts;
-
-    istringstream lineString(line);
-
-    getline(lineString, code, ',');
-    getline(lineString, name, ',');
-
-    try
+    if (!saveSnapshot(snapshotFile, countriesGraph))
     {
-      getline(lineString, ts, ',');
-      latitude = stod(ts);
-      ts = "";
+      cout << "Could not write snapshot " << snapshotFile << endl;
+      return 1;
     }
-    catch (const invalid_argument &ia)
+    return 0;
+  }
+  countriesGraph.buildSearchIndex();
+  // Reuse a saved all pairs table, it is ignored if the dataset has changed since
+  string distanceTableFile = "world_distances.bin";
+  countriesGraph.allPairs.load(distanceTableFile, countriesGraph.adjacencyChecksum());
+  if (argc > 1 && strcmp(argv[1], "--all-pairs") == 0)
+  {
+    countriesGraph.allPairsDijkstra();
+    return countriesGraph.allPairs.save(distanceTableFile) ? 0 : 1;
+  }
+  if (argc > 1 && strcmp(argv[1], "--check-batch") == 0)
+    return checkBatch(countriesGraph) == 0 ? 0 : 1;
+  // --batch [file] [--csv]: commands from the file (or stdin), no menu
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--batch") != 0)
+      continue;
+    bool csv = false;
+    string commandFile = "-";
+    for (int j = i + 1; j < argc; j++)
     {
-      errcount++;
-      cerr << "Invalid argument: " << ia.what() << endl;
-      cout << "id: " << (i + 1) << endl;
-      latitude = 0;
+      if (strcmp(argv[j], "--csv") == 0)
+        csv = true;
+      else if (strcmp(argv[j], "--jsonl") != 0)
+        commandFile = argv[j];
     }
-
-    try
+    if (commandFile != "-" && !ifstream(commandFile))
     {
-      getline(lineString, ts, ',');
-      longitude = stod(ts);
-      ts = "";
+      cout << "Could not read " << commandFile << endl;
+      return 1;
     }
-    catch (const invalid_argument &ia)
+    string input;
+    MappedFile mapped(commandFile == "-" ? "" : commandFile);
+    if (commandFile == "-")
+      input.assign(istreambuf_iterator<char>(cin), istreambuf_iterator<char>());
+    OutputBuffer out(stdout);
+    ResultCache cache(countriesGraph);
+    BatchRunner runner(countriesGraph, out, csv, threadScratch(), cache);
+    runner.run(commandFile == "-" ? string_view(input) : mapped.data());
+    return 0;
+  }
+#ifndef _WIN32
+  // --serve [address] [workers]: answer queries over a socket until stopped
+  // --load [address] [connections] [seconds]: drive a running server
+  // --bench-server [workers] [connections] [seconds]: both in one process,
+  // by default with more connections than workers
+  if (argc > 1 && strcmp(argv[1], "--bench-server") == 0)
+  {
+    int workers = argc > 2 ? atoi(argv[2]) : 2;
+    int connections = argc > 3 ? atoi(argv[3]) : 4 * workers;
+    string address = "countries-bench.sock";
+    QueryServer server(countriesGraph);
+    if (!server.listen(address))
     {
-      errcount++;
-      cerr << "Invalid argument: " << ia.what() << endl;
-      cout << "id: " << (i + 1) << endl;
-      longitude = 0;
+      cout << "Could not listen on " << address << endl;
+      return 1;
     }
-
-    getline(lineString, ts, ',');
-    population = atoi(ts.c_str());
-    ts = "";
-
-    getline(lineString, ts, ',');
-    if (!ts.empty() && ts.front() == '"')
+    cout << workers << " workers" << endl;
+    thread([&server, workers]()
+           { server.run(workers); })
+        .detach();
+    runLoadGenerator(address, nodes, connections, argc > 4 ? atof(argv[4]) : 5.0);
+    unlink(address.c_str());
+    // The server threads never return: exit() leaves main's locals, which
+    // they wait on, alone and still writes metrics
+    exit(0);
+  }
+  if (argc > 1 && (strcmp(argv[1], "--serve") == 0 || strcmp(argv[1], "--load") == 0))
+  {
+    string address = argc > 2 ? argv[2] : "countries.sock";
+    if (strcmp(argv[1], "--load") == 0)
     {
-      string temp = "";
-      getline(lineString, temp, '"');
-      ts += ',' + temp;
-      if (ts[ts.size() - 1] == ',')
-        ts = ts.substr(1, ts.size() - 2);
-      else
-        ts = ts.substr(1);
+      runLoadGenerator(address, nodes, argc > 3 ? atoi(argv[3]) : 4, argc > 4 ? atof(argv[4]) : 5.0);
+      return 0;
     }
-    string countryName = "";
-    for (int i = 0; i < ts.size(); i++)
+    int workers = argc > 3 ? atoi(argv[3]) : max(1u, thread::hardware_concurrency());
+    QueryServer server(countriesGraph);
+    if (!server.listen(address))
     {
-      if (ts[i] == ',')
-      {
-        adjacentCountries.push_back(countryName);
-        countryName = "";
-      }
-      else if (ts[i] != '"')
-      {
-        countryName += ts[i];
-      }
+      cout << "Could not listen on " << address << endl;
+      return 1;
     }
-    adjacentCountries.push_back(countryName);
-    countryName = "";
-    ts = "";
-
-    getline(lineString, ts, ',');
-    ts = "";
-    getline(lineString, ts, ',');
-    area = atoi(ts.c_str());
-    ts = "";
-
-    Node node((i), code, name, latitude, longitude, population, area, adjacentCountries);
-    nodes.push_back(node);
-    line = "";
-    i++;
+    cout << "Serving on " << address << " with " << workers << " workers" << endl;
+    server.run(workers);
+    return 0;
   }
-
-  // Graph
-  vector<tuple<int, int, int>> weightedEdges;
-  for (auto &node : nodes)
-  {
-    for (auto &adjCountryName : node.adjacentCountries)
-    {
-      for (auto &countryNode : nodes)
-      {
-        if (countryNode.name.compare(adjCountryName) == 0)
-        {
-
-          int fromId = node.id;
-          int toId = countryNode.id;
-          int distance = (int)haversineDistance(node.latitude, node.longitude, countryNode.latitude, countryNode.longitude);
-          tuple<int, int, int> edge = make_tuple(fromId, toId, distance);
-          weightedEdges.push_back(edge);
-        }
-      }
-    }
-    // LinkedList *p = NULL;
-    // if (node.adjacentCountries != NULL)
-    // {
-    //   p = node.adjacentCountries->next;
-    // }
-    // do
-    // {
-    //   cout << (p->countryNode->code) << endl;
-    //   int fromId = node.id;
-    //   int toId = p->countryNode->id;
-    //   cout << node.latitude << endl;
-    //   cout << node.longitude << endl;
-    //   cout << p->countryNode->latitude << endl;
-    //   cout << p->countryNode->longitude << endl;
-    //   cout << endl;
-    //   int distance = (int)haversineDistance(node.latitude, node.longitude, p->countryNode->latitude, p->countryNode->longitude);
-    //   // cout << distance << endl;
-    //   tuple<int, int, int> edge = make_tuple(fromId, toId, distance);
-    //   weightedEdges.push_back(edge);
-    //   p = p->next;
-    // } while (p != node.adjacentCountries);
-  }
-  Graph countriesGraph(nodes, weightedEdges);
+#endif
   stack<pair<string, time_t>> searchHistory;
   int option;
   while (true)
@@ -680,6 +7697,10 @@ int main()
     cout << "6: Prim's Algorithm (Minimum Spanning Tree)" << endl;
     cout << "7: BFS Traversal of countries" << endl;
     cout << "8: DFS Traversal of countries" << endl;
+    cout << "9: Precompute all-pairs distance table" << endl;
+    cout << "10: Build contraction hierarchy for faster shortest paths" << endl;
+    cout << "11: Build ALT landmarks for faster shortest paths" << endl;
+    cout << "12: Find countries near a country" << endl;
     cout << "0: Exit: " << endl
          << endl;
     cout << "Enter: ";
@@ -698,7 +7719,18 @@ int main()
       pair<string, int> pair = make_pair(query, now);
       searchHistory.push(pair);
       cout << endl;
-      countriesGraph.searchCountries(query);
+      vector<int> matches = countriesGraph.searchCountries(query);
+      if (matches.empty())
+      {
+        // Nothing contains the query, allow a typo per four characters
+        matches = countriesGraph.searchCountries(query, 10, min(2, (int)query.size() / 4));
+        if (!matches.empty())
+          cout << "No exact matches, closest names:" << endl;
+      }
+      for (int id : matches)
+      {
+        countriesGraph.displayCountry(id);
+      }
     }
     else if (option == 3)
     {
@@ -735,11 +7767,13 @@ int main()
       int populationLimit = -1;
       bool areaFlag = true;
       int areaLimit = -1;
+      RangeFilter box;
       while (true)
       {
         cout << "1: Enter Population Criteria" << endl;
         cout << "2: Enter Area Criteria" << endl;
         cout << "3: Print List" << endl;
+        cout << "4: Enter Latitude/Longitude Range" << endl;
         cout << "0: Back" << endl;
         cout << "Enter: ";
         cin >> option1;
@@ -763,7 +7797,12 @@ int main()
         }
         else if (option1 == 3)
         {
-          vector<PriorityQueue> queues = countriesGraph.filterCountries(populationFlag, populationFlag, areaFlag, areaLimit);
+          RangeFilter filter = box;
+          if (populationLimit != -1)
+            (populationFlag ? filter.minPopulation : filter.maxPopulation) = populationLimit;
+          if (areaLimit != -1)
+            (areaFlag ? filter.minArea : filter.maxArea) = areaLimit;
+          vector<PriorityQueue> queues = countriesGraph.filterCountries(filter);
           PriorityQueue populationq = queues[0];
           PriorityQueue areaq = queues[1];
           int option2;
@@ -772,6 +7811,7 @@ int main()
             cout << "----------------------------------------------------------" << endl;
             cout << "1: Sort by Population" << endl;
             cout << "2: Sort by Area" << endl;
+            cout << "3: Top K" << endl;
             cout << "0: Back" << endl;
             cout << "Enter: ";
             cin >> option2;
@@ -794,12 +7834,37 @@ int main()
               areaq.display(ascend);
               cout << "----------------------------------------------------------" << endl;
             }
+            else if (option2 == 3)
+            {
+              cout << "----------------------------------------------------------" << endl;
+              bool byArea;
+              int k;
+              cout << "Rank by Population (0) or Area (1): ";
+              cin >> byArea;
+              cout << "How many countries: ";
+              cin >> k;
+              vector<int> top = byArea ? areaq.topK(k) : populationq.topK(k);
+              for (int i = 0; i < (int)top.size(); i++)
+              {
+                nodes.displayNode(top[i], i + 1);
+              }
+              cout << "----------------------------------------------------------" << endl;
+            }
             else
             {
               break;
             }
           }
         }
+        else if (option1 == 4)
+        {
+          cout << "----------------------------------------------------------" << endl;
+          cout << "Enter minimum and maximum latitude: ";
+          cin >> box.minLatitude >> box.maxLatitude;
+          cout << "Enter minimum and maximum longitude: ";
+          cin >> box.minLongitude >> box.maxLongitude;
+          cout << "----------------------------------------------------------" << endl;
+        }
         else if (option1 == 0)
         {
           break;
@@ -812,16 +7877,16 @@ int main()
       cout << "Enter your source country: ";
       getline(cin >> ws, source);
 
-      int sourceId = findCountry(nodes, source);
+      int sourceId = countriesGraph.findCountry(source);
 
       if (sourceId != -1)
       {
         string destination;
         cout << "Enter your destination country: ";
         getline(cin >> ws, destination);
-        int destId = findCountry(nodes, destination);
+        int destId = countriesGraph.findCountry(destination);
         if (destId != -1)
-          countriesGraph.dijkstra(sourceId, destId, nodes);
+          countriesGraph.dijkstra(sourceId, destId);
         else
           cout << endl
                << "Country does not exist" << endl;
@@ -837,10 +7902,10 @@ int main()
       string source;
       cout << "Enter source country: ";
       getline(cin >> ws, source);
-      int sourceID = findCountry(nodes, source);
+      int sourceID = countriesGraph.findCountry(source);
       if (sourceID != -1)
       {
-        countriesGraph.prims(sourceID, nodes);
+        countriesGraph.prims(sourceID);
       }
       else
       {
@@ -854,7 +7919,7 @@ int main()
       cout << "Enter source country: ";
       cin >> source;
       cout << endl;
-      int sourceID = findCountry(nodes, source);
+      int sourceID = countriesGraph.findCountry(source);
       if (sourceID != -1)
       {
         countriesGraph.bfsTraversal(sourceID);
@@ -871,7 +7936,7 @@ int main()
       cout << "Enter source country: ";
       cin >> source;
       cout << endl;
-      int sourceID = findCountry(nodes, source);
+      int sourceID = countriesGraph.findCountry(source);
       if (sourceID != -1)
       {
         countriesGraph.dfsTraversal(sourceID);
@@ -882,6 +7947,67 @@ int main()
              << "Country does not exist" << endl;
       }
     }
+    else if (option == 9)
+    {
+      auto start = chrono::steady_clock::now();
+      countriesGraph.allPairsDijkstra();
+      cout << "Computed distances between all " << countriesGraph.numberOfNodes << " countries in " << elapsedMs(start) << " ms" << endl;
+      if (countriesGraph.allPairs.save(distanceTableFile))
+        cout << "Saved to " << distanceTableFile << endl;
+      else
+        cout << "Could not save " << distanceTableFile << endl;
+    }
+    else if (option == 10)
+    {
+      auto start = chrono::steady_clock::now();
+      countriesGraph.buildHierarchy();
+      cout << "Contraction hierarchy built in " << elapsedMs(start) << " ms with " << countriesGraph.hierarchy.shortcuts << " shortcuts" << endl;
+    }
+    else if (option == 11)
+    {
+      auto start = chrono::steady_clock::now();
+      countriesGraph.buildLandmarks(8);
+      cout << countriesGraph.landmarkDistance.size() << " landmarks built in " << elapsedMs(start) << " ms" << endl;
+    }
+    else if (option == 12)
+    {
+      string source;
+      cout << "Enter country: ";
+      getline(cin >> ws, source);
+      int sourceID = countriesGraph.findCountry(source);
+      if (sourceID == -1)
+      {
+        cout << endl
+             << "Country does not exist" << endl;
+        continue;
+      }
+      bool byRadius;
+      cout << "Nearest K countries (0) or all within a radius (1)?: ";
+      cin >> byRadius;
+      double latitude = nodes.latitudes[sourceID], longitude = nodes.longitudes[sourceID];
+      vector<pair<int, double>> nearby;
+      if (byRadius)
+      {
+        double radius;
+        cout << "Enter radius in km: ";
+        cin >> radius;
+        nearby = countriesGraph.countriesWithin(latitude, longitude, radius);
+      }
+      else
+      {
+        int k;
+        cout << "How many countries: ";
+        cin >> k;
+        // The country itself comes back first
+        nearby = countriesGraph.nearestCountries(latitude, longitude, k + 1);
+      }
+      cout << endl;
+      for (auto &entry : nearby)
+      {
+        if (entry.first != sourceID)
+          cout << nodes.name(entry.first) << " (" << nodes.code(entry.first) << "): " << (int)entry.second << "km" << endl;
+      }
+    }
     else
     {
       break;